@@ -0,0 +1,151 @@
+#include "AdmissionChecker.hpp"
+
+#include <algorithm>
+
+#include <Ip.hpp>
+
+#include <config.hpp>
+
+#include <nlohmann/json.hpp>
+
+// ipv4 keys are tagged with ones in the high bits, where ipv6 keys only
+// collide with multicast addresses, which can't connect
+static constexpr u64 ipv4Tag = 0xFFFFFFFFull << 32;
+
+static constexpr u8 ipv4Mapped[12] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xFF, 0xFF};
+
+// big endian, so shorter prefixes keep the first bytes
+static u64 readBe(const u8 * p, u32 bytes) {
+	u64 v = 0;
+	for (u32 i = 0; i < bytes; i++) {
+		v = v << 8 | p[i];
+	}
+
+	return v;
+}
+
+static bool isIpv4(const u8 * addr) {
+	return std::equal(ipv4Mapped, ipv4Mapped + sizeof(ipv4Mapped), addr);
+}
+
+static u64 mix(u64 k) {
+	k ^= k >> 33;
+	k *= 0xFF51AFD7ED558CCDull;
+	k ^= k >> 33;
+	return k;
+}
+
+TokenBucketTable::TokenBucketTable(u32 size, u16 burst, u16 perSeconds)
+: entries(std::make_unique<Entry[]>(size)),
+  mask(size - 1),
+  replaced(0) {
+	setRate(burst, perSeconds);
+}
+
+void TokenBucketTable::setRate(u16 burst, u16 perSeconds) {
+	this->burst = std::max<u16>(burst, 1);
+	rate = this->burst / (std::max<u16>(perSeconds, 1) * 1000.f);
+}
+
+float& TokenBucketTable::refill(u64 key, u32 nowMs) {
+	// 0 marks unused slots
+	nowMs |= 1;
+
+	// entries are never removed, so the key can't be past an unused slot
+	u32 pos = mix(key) & mask;
+	Entry * e = nullptr;
+	Entry * victim = nullptr;
+	for (u32 i = 0; i < maxProbes; i++) {
+		Entry& cur = entries[(pos + i) & mask];
+		if (cur.lastMs == 0) {
+			victim = &cur;
+			break;
+		}
+
+		if (cur.key == key) {
+			e = &cur;
+			break;
+		}
+
+		if (!victim || nowMs - cur.lastMs > nowMs - victim->lastMs) {
+			victim = &cur;
+		}
+	}
+
+	if (!e) {
+		if (victim->lastMs != 0) {
+			++replaced;
+		}
+
+		e = victim;
+		e->key = key;
+		e->tokens = burst;
+		e->lastMs = nowMs;
+	}
+
+	e->tokens = std::min(burst, e->tokens + (nowMs - e->lastMs) * rate);
+	e->lastMs = nowMs;
+	return e->tokens;
+}
+
+u64 TokenBucketTable::getReplaced() const {
+	return replaced;
+}
+
+AdmissionChecker::AdmissionChecker()
+: start(std::chrono::steady_clock::now()),
+  perIp(SERVER_ADMISSION_TABLE_SIZE, SERVER_ADMISSION_IP_RATELIMIT),
+  perPrefix(SERVER_ADMISSION_TABLE_SIZE, SERVER_ADMISSION_PREFIX_RATELIMIT),
+  admitted(0),
+  rejectedIp(0),
+  rejectedPrefix(0) { }
+
+void AdmissionChecker::setIpRate(u16 burst, u16 perSeconds) {
+	perIp.setRate(burst, perSeconds);
+}
+
+void AdmissionChecker::setPrefixRate(u16 burst, u16 perSeconds) {
+	perPrefix.setRate(burst, perSeconds);
+}
+
+bool AdmissionChecker::admit(const Ip& ip) {
+	u32 now = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+
+	// a rejected ip doesn't use up the tokens of its prefix
+	const u8 * addr = ip.getBytes();
+	float& prefixTokens = perPrefix.refill(prefixKey(addr), now);
+	float& ipTokens = perIp.refill(ipKey(addr), now);
+	if (prefixTokens < 1.f) {
+		++rejectedPrefix;
+		return false;
+	}
+
+	if (ipTokens < 1.f) {
+		++rejectedIp;
+		return false;
+	}
+
+	prefixTokens -= 1.f;
+	ipTokens -= 1.f;
+	++admitted;
+	return true;
+}
+
+nlohmann::json AdmissionChecker::getPublicInfo() {
+	return {
+		{"admitted", admitted},
+		{"rejectedIp", rejectedIp},
+		{"rejectedPrefix", rejectedPrefix},
+		{"replacedEntries", perIp.getReplaced() + perPrefix.getReplaced()}
+	};
+}
+
+// the whole ipv4 address, or the ipv6 /64
+u64 AdmissionChecker::ipKey(const u8 * addr) {
+	return isIpv4(addr) ? ipv4Tag | readBe(addr + 12, 4) : readBe(addr, 8);
+}
+
+// the ipv4 /24, or the ipv6 /48
+u64 AdmissionChecker::prefixKey(const u8 * addr) {
+	return isIpv4(addr) ? ipv4Tag | readBe(addr + 12, 3) : readBe(addr, 6);
+}
@@ -0,0 +1,67 @@
+#pragma once
+
+#include "ConnectionProcessor.hpp"
+
+#include <chrono>
+#include <memory>
+
+#include <explints.hpp>
+
+class Ip;
+
+// Token buckets in an open addressing table with a fixed size. When a key
+// can't be placed, the entry that was used the longest time ago is replaced,
+// its bucket was the closest to being full again anyway
+class TokenBucketTable {
+	struct Entry {
+		u64 key;
+		float tokens;
+		u32 lastMs; // 0 if the slot is unused
+	};
+
+	static constexpr u32 maxProbes = 8;
+
+	std::unique_ptr<Entry[]> entries;
+	const u32 mask;
+	float rate; // tokens per ms
+	float burst;
+	u64 replaced;
+
+public:
+	// size must be a power of 2
+	TokenBucketTable(u32 size, u16 burst, u16 perSeconds);
+
+	void setRate(u16 burst, u16 perSeconds);
+	// refills the bucket of key, and returns its tokens to check and take
+	// one from. valid until the next call
+	float& refill(u64 key, u32 nowMs);
+
+	u64 getReplaced() const;
+};
+
+// Rate limits new connections per ip and per /24 (ipv4) or /48 (ipv6),
+// so floods are rejected before the handshake is parsed. A connection
+// only takes tokens if both buckets have one. Ipv6 addresses are limited per /64
+class AdmissionChecker : public ConnectionProcessor {
+	const std::chrono::steady_clock::time_point start;
+	TokenBucketTable perIp;
+	TokenBucketTable perPrefix;
+	u64 admitted;
+	u64 rejectedIp;
+	u64 rejectedPrefix;
+
+public:
+	AdmissionChecker();
+
+	void setIpRate(u16 burst, u16 perSeconds);
+	void setPrefixRate(u16 burst, u16 perSeconds);
+
+	bool admit(const Ip&);
+
+	nlohmann::json getPublicInfo();
+
+	// addr is the 16 byte ipv6 address in network order, with ipv4 mapped
+	// to ::ffff:a.b.c.d
+	static u64 ipKey(const u8 * addr);
+	static u64 prefixKey(const u8 * addr);
+};
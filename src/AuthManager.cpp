@@ -24,7 +24,8 @@ bool check16ByteaToken(std::string_view token) {
 }
 
 AuthManager::AuthManager(AsyncPostgres& uvdb)
-: uvdb(uvdb) { }
+: uvdb(uvdb),
+  nextLoadId(0) { }
 
 std::optional<std::pair<u64, std::array<u8, 16>>> AuthManager::parseToken(std::string_view token) {
 	sz_t toksz = token.size();
@@ -73,24 +74,23 @@ void AuthManager::updateRank(UviasRank rank) {
 		it->second = rank;
 
 		// this is probably quite slow
-		for (auto& usrp : userCache) {
+		userCache.forEach([&rank] (auto& usrp) {
 			if (auto usr = usrp.second.lock(); usr && usr->getUviasRank().getId() == rank.getId()) {
 				usr->updateUser(rank);
 			}
-		}
+		});
 	} else {
 		ranks.insert_or_assign(rank.getId(), rank);
 	}
 }
 
 ll::shared_ptr<User> AuthManager::getUser(User::Id uid) {
-	auto it = userCache.find(uid);
-	if (it != userCache.end()) {
-		if (auto usr = it->second.lock()) {
+	if (auto * e = userCache.find(uid)) {
+		if (auto usr = e->second.lock()) {
 			return usr;
 		} else {
 			// pointer expired, delete
-			userCache.erase(it);
+			userCache.erase(uid);
 		}
 	}
 
@@ -98,14 +98,12 @@ ll::shared_ptr<User> AuthManager::getUser(User::Id uid) {
 }
 
 ll::shared_ptr<Session> AuthManager::getSession(std::string_view tok) {
-	// XXX: this is disgusting, fix once c++ allows is_transparent on unordered maps
-	auto it = sessions.find(std::string(tok));
-	if (it != sessions.end()) {
-		if (auto sess = it->second.lock()) {
+	if (auto * e = sessions.find(tok)) {
+		if (auto sess = e->second.lock()) {
 			return sess;
 		} else {
 			// pointer expired, delete
-			sessions.erase(it);
+			sessions.erase(tok);
 		}
 	}
 
@@ -113,20 +111,20 @@ ll::shared_ptr<Session> AuthManager::getSession(std::string_view tok) {
 }
 
 bool AuthManager::kickSession(std::string_view tok) {
-	auto it = sessions.find(std::string(tok));
-	if (it != sessions.end()) {
-		return true;
-	}
-
-	return false;
+	return sessions.find(tok) != nullptr;
 }
 
 void AuthManager::forEachSession(std::function<void(const std::string&, ll::shared_ptr<Session>)> f) {
-	for (const auto& session : sessions) {
+	sessions.forEach([&f] (const auto& session) {
 		if (auto sessp = session.second.lock()) {
 			f(session.first, std::move(sessp));
 		}
-	}
+	});
+}
+
+// includes sessions that expired, but weren't removed from the map yet
+sz_t AuthManager::sessionCount() const {
+	return sessions.size();
 }
 
 std::function<bool()> AuthManager::useSsoToken(std::string_view ssoToken, std::string_view serviceId, std::function<void(std::optional<std::string>, bool)> cb) {
@@ -155,6 +153,8 @@ std::function<bool()> AuthManager::useSsoToken(std::string_view ssoToken, std::s
 	};
 }
 
+// connections with the same token share one query, the returned function
+// only cancels it if no one else is waiting for it
 std::function<bool()> AuthManager::loadSession(std::string_view tokStr, std::function<void(ll::shared_ptr<Session>)> f) {
 	auto tok = AuthManager::parseToken(tokStr);
 	if (!tok) {
@@ -162,27 +162,44 @@ std::function<bool()> AuthManager::loadSession(std::string_view tokStr, std::fun
 		return nullptr;
 	}
 
+	std::string tokKey(tokStr);
+	auto loading = loadingSessions.find(tokKey);
+	if (loading != loadingSessions.end()) {
+		return addSessionWaiter(loading->second, loading->first, std::move(f));
+	}
+
 	auto q = uvdb.query("SELECT extract(EPOCH FROM u.created)::BIGINT, creator_ip, "
 				"username, accounts.get_total_rep(s.uid), rank_id "
 			"FROM accounts.get_session($1::BIGINT, $2::BYTEA) AS s "
 			"INNER JOIN accounts.users AS u ON u.uid = s.uid",
 		static_cast<i64>(tok->first), tok->second);
 
-	q->then([this, cb{std::move(f)}, uid{tok->first}, tokStr{std::string(tokStr)}] (AsyncPostgres::Result r) {
+	// the waiter is registered first, then could run the callback right away
+	const u64 loadId = nextLoadId++;
+	auto& load = loadingSessions[tokKey];
+	load.id = loadId;
+	load.nextWaiter = 0;
+	load.cancelQuery = [this, q] {
+		return uvdb.cancelQuery(*q);
+	};
+
+	auto cancel(addSessionWaiter(load, tokKey, std::move(f)));
+	q->then([this, loadId, uid{tok->first}, tokStr{tokKey}] (AsyncPostgres::Result r) {
 		if (!r.size()) {
-			cb(nullptr);
+			sessionLoaded(tokStr, loadId, nullptr);
 			return;
 		}
 
 		auto [creationSecs, ip, username, totalRep, rankId] = r[0].get<i64, Ip, std::string, User::Rep, UviasRank::Id>();
 
 		auto creationTime(std::chrono::system_clock::from_time_t(creationSecs));
+		sweepExpired();
 		auto usr(getUser(uid));
 		if (!usr) {
 			std::optional<UviasRank> rank(getRank(rankId));
 
 			if (!rank) {
-				cb(nullptr);
+				sessionLoaded(tokStr, loadId, nullptr);
 				return;
 			}
 
@@ -190,19 +207,65 @@ std::function<bool()> AuthManager::loadSession(std::string_view tokStr, std::fun
 			userCache.insert_or_assign(uid, usr);
 		}
 
-		// this can happen, if the user connects multiple times at the same time
-		// some time is wasted on unused queries, if this is the case though
-		// could be optimized, but this is the simplest way of fixing it
+		// can be loaded already, if every waiter of an earlier query
+		// cancelled after it was too late to cancel the query
 		auto ses(getSession(tokStr));
 		if (!ses) {
 			ses = ll::make_shared<Session>(std::move(usr), ip, creationTime);
 			sessions.insert_or_assign(tokStr, ses);
 		}
 
-		cb(std::move(ses));
+		sessionLoaded(tokStr, loadId, std::move(ses));
 	});
 
-	return [this, q{std::move(q)}] {
-		return uvdb.cancelQuery(*q);
+	return cancel;
+}
+
+std::function<bool()> AuthManager::addSessionWaiter(SessionLoad& load, const std::string& tok, std::function<void(ll::shared_ptr<Session>)> f) {
+	u32 waiter = load.nextWaiter++;
+	load.waiters.emplace(waiter, std::move(f));
+
+	return [this, tok, loadId{load.id}, waiter] {
+		auto it = loadingSessions.find(tok);
+		if (it == loadingSessions.end() || it->second.id != loadId) {
+			return false;
+		}
+
+		SessionLoad& load = it->second;
+		load.waiters.erase(waiter);
+		if (!load.waiters.empty()) {
+			return true;
+		}
+
+		// the last waiter left, the result is dropped even if the query
+		// can't be cancelled anymore
+		bool cancelled = load.cancelQuery();
+		loadingSessions.erase(it);
+		return cancelled;
 	};
 }
+
+void AuthManager::sessionLoaded(const std::string& tok, u64 loadId, ll::shared_ptr<Session> ses) {
+	auto it = loadingSessions.find(tok);
+	if (it == loadingSessions.end() || it->second.id != loadId) {
+		// everyone cancelled
+		return;
+	}
+
+	auto waiters(std::move(it->second.waiters));
+	loadingSessions.erase(it);
+	for (auto& w : waiters) {
+		w.second(ses);
+	}
+}
+
+// checks a few entries of each cache on every loaded session, so expired
+// pointers that are never looked up again get removed before the maps grow
+void AuthManager::sweepExpired() {
+	auto expired = [] (auto& e) {
+		return !e.second.lock();
+	};
+
+	sessions.sweep(8, expired);
+	userCache.sweep(8, expired);
+}
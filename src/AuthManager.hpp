@@ -7,7 +7,9 @@
 #include <string_view>
 #include <functional>
 #include <unordered_map>
+#include <map>
 
+#include <OpenHashMap.hpp>
 #include <UviasRank.hpp>
 #include <Session.hpp>
 #include <User.hpp>
@@ -19,10 +21,20 @@ class AsyncPostgres;
 class SessionChecker;
 
 class AuthManager {
+	// one query per token, shared by every connection waiting for it
+	struct SessionLoad {
+		u64 id;
+		std::function<bool()> cancelQuery;
+		std::map<u32, std::function<void(ll::shared_ptr<Session>)>> waiters;
+		u32 nextWaiter;
+	};
+
 	AsyncPostgres& uvdb;
 	std::unordered_map<UviasRank::Id, UviasRank> ranks;
-	std::unordered_map<std::string, ll::weak_ptr<Session>> sessions; // token as key
-	std::unordered_map<User::Id, ll::weak_ptr<User>> userCache;
+	OpenHashMap<std::string, ll::weak_ptr<Session>, TransparentStringHash> sessions; // token as key
+	OpenHashMap<User::Id, ll::weak_ptr<User>> userCache;
+	std::unordered_map<std::string, SessionLoad> loadingSessions; // token as key
+	u64 nextLoadId;
 
 public:
 	AuthManager(AsyncPostgres&);
@@ -39,11 +51,15 @@ public:
 	ll::shared_ptr<Session> getSession(std::string_view);
 	bool kickSession(std::string_view);
 	void forEachSession(std::function<void(const std::string&, ll::shared_ptr<Session>)>);
+	sz_t sessionCount() const;
 
 	std::function<bool()> useSsoToken(std::string_view ssoToken, std::string_view serviceId, std::function<void(std::optional<std::string>, bool)>);
 
 private:
 	std::function<bool()> loadSession(std::string_view, std::function<void(ll::shared_ptr<Session>)>);
+	std::function<bool()> addSessionWaiter(SessionLoad&, const std::string& tok, std::function<void(ll::shared_ptr<Session>)>);
+	void sessionLoaded(const std::string& tok, u64 loadId, ll::shared_ptr<Session>);
+	void sweepExpired();
 
 	friend SessionChecker;
 };
@@ -47,8 +47,8 @@ bool CaptchaChecker::preCheck(IncomingConnection& ic, HttpData) {
 		return true;
 	}
 
-	auto search = ic.args.find("captcha");
-	if (search == ic.args.end() || search->second.size() > 4096) {
+	auto captcha = ic.args.get("captcha");
+	if (!captcha || captcha->size() > 4096) {
 		return false;
 	}
 
@@ -56,7 +56,7 @@ bool CaptchaChecker::preCheck(IncomingConnection& ic, HttpData) {
 }
 
 void CaptchaChecker::asyncCheck(IncomingConnection& ic, std::function<void(bool)> cb) {
-	rcra.check(ic.ip, ic.args.at("captcha"), [this, &ic, end{std::move(cb)}] (auto res, auto) {
+	rcra.check(ic.ip, std::string(*ic.args.get("captcha")), [this, &ic, end{std::move(cb)}] (auto res, auto) {
 		// if request OK and token verified, continue
 		end(res && *res);
 	});
@@ -4,8 +4,14 @@
 #include <iostream>
 #include <fstream>
 #include <cstdio> // std::remove
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+
+#include <zlib.h>
 
 #include <rle.hpp>
+#include <PngImage.hpp>
 #include <utils.hpp>
 #include <Storage.hpp>
 
@@ -21,15 +27,78 @@ static_assert((Chunk::size % Chunk::protectionAreaSize) == 0,
 static_assert((Chunk::pc & (Chunk::pc - 1)) == 0,
 	"size / protectionAreaSize must result in a power of 2");
 
-Chunk::Chunk(Pos x, Pos y, const WorldStorage& ws)
+// C_RAW chunk file layout: this header, the woPp protection rle
+// and then the rgb pixels of the chunk, compressed with zlib
+struct RawChunkHeader {
+	char magic[4];
+	u8 version;
+	u8 reserved[3];
+	u32 width;
+	u32 height;
+	u32 protSize; // 0 if there's no protection data
+	u32 pixelsSize; // compressed
+} __attribute__((packed));
+
+static_assert(Chunk::pngBandCount > 0,
+	"Chunk::size must be at least as big as one png band");
+
+static void putU32Be(std::vector<u8>& v, u32 n) {
+	v.push_back(n >> 24);
+	v.push_back(n >> 16);
+	v.push_back(n >> 8);
+	v.push_back(n);
+}
+
+// returns the offset to pass to endPngChunk after writing the chunk data
+static sz_t beginPngChunk(std::vector<u8>& v, const char (&type)[5]) {
+	sz_t start = v.size();
+	putU32Be(v, 0); // length, filled later
+	v.insert(v.end(), type, type + 4);
+	return start;
+}
+
+static void endPngChunk(std::vector<u8>& v, sz_t start) {
+	u32 len = v.size() - start - 8;
+	u8 * p = v.data() + start;
+	p[0] = len >> 24;
+	p[1] = len >> 16;
+	p[2] = len >> 8;
+	p[3] = len;
+	putU32Be(v, crc32(crc32(0, nullptr, 0), p + 4, len + 4));
+}
+
+static constexpr char rawChunkMagic[4] = {'w', 'o', 'R', 'C'};
+
+static void removeChunkFile(const std::string& fpath) {
+	if (std::remove(fpath.c_str()) && errno != ENOENT) {
+		std::string s("Couldn't delete chunk file (" + fpath + ")");
+		std::perror(s.c_str());
+	}
+}
+
+Chunk::Chunk(Pos x, Pos y, WorldStorage& ws)
 : lastAction(std::chrono::steady_clock::now()),
   x(x),
   y(y),
   ws(ws),
-  canUnload(false), // DON'T unload before this is constructed (can happen by alloc fail)
+  pngMemory(0),
+  version(std::chrono::duration_cast<std::chrono::microseconds>(
+      std::chrono::system_clock::now().time_since_epoch()).count()),
+  pngCacheVersion(0),
+  unloadLocks(1), // DON'T unload before this is constructed (can happen by alloc fail)
   protectionDataEmpty(false),
-  pngCacheOutdated(true),
-  pngFileOutdated(false) {
+  pngFileOutdated(false),
+  saving(false),
+  legacyFile(false),
+  loaded(false) {
+	dirtyPngBands.set();
+	preventUnloading(false);
+}
+
+// reads the chunk file, meant to be called once from a TaskBuffer thread.
+// the chunk must not be touched by other threads until isLoaded() is true
+void Chunk::load(RGB_u bgClr) {
+	PngImage png;
 	bool readerCalled = false;
   	auto fail = [this] {
   		std::cerr << "Protection data corrupted for chunk "
@@ -39,7 +108,7 @@ Chunk::Chunk(Pos x, Pos y, const WorldStorage& ws)
 		protectionDataEmpty = true;
   	};
 
-	data.setChunkReader("woPp", [this, fail{std::move(fail)}, &readerCalled] (u8 * d, sz_t size) {
+	png.setChunkReader("woPp", [this, fail{std::move(fail)}, &readerCalled] (u8 * d, sz_t size) {
 		// returning false will throw
 		// instead of stopping the server, reset the protections
 		// for this chunk
@@ -59,46 +128,92 @@ Chunk::Chunk(Pos x, Pos y, const WorldStorage& ws)
 		return true;
 	});
 
-	data.setChunkWriter("woPp", [this] {
-		std::shared_lock<std::shared_timed_mutex> _(sm);
-		if (protectionDataEmpty) {
-			// don't write protection data if it's all 0
-			return std::pair<std::unique_ptr<u8[]>, sz_t>{nullptr, 0};
-		}
+	std::vector<u8> stored(ws.getRegionCache().read(x, y));
+	if (stored.size() != 0) {
+		readRaw(stored.data(), stored.size(), bgClr);
+		loaded.store(true, std::memory_order_release);
+		return;
+	}
 
-		return rle::compress(protectionData.data(), protectionData.size());
-	});
+	std::ifstream raw(ws.getChunkFilePath(x, y, C_RAW), std::ios::binary | std::ios::ate);
+	std::ifstream ch;
+	if (!raw) {
+		ch.open(ws.getChunkFilePath(x, y, C_PNG), std::ios::binary | std::ios::ate);
+	}
+
+	if (raw || ch) {
+		// will be moved to the region file on the next save
+		legacyFile = true;
+		pngFileOutdated = true;
+	}
+
+	if (raw) {
+		sz_t size = raw.tellg();
+		raw.seekg(0);
+		auto buf(std::make_unique<u8[]>(size));
+		raw.read(reinterpret_cast<char *>(buf.get()), size);
 
-	std::ifstream ch(ws.getChunkFilePath(x, y), std::ios::binary | std::ios::ate);
-	if (ch) {
+		// the png will be encoded if someone views this chunk
+		readRaw(buf.get(), size, bgClr);
+	} else if (ch) {
 		sz_t size = ch.tellg();
 		ch.seekg(0);
-		pngCache.resize(size);
-		ch.read(reinterpret_cast<char *>(pngCache.data()), size);
-		pngCacheOutdated = false;
+		std::vector<u8> file(size);
+		ch.read(reinterpret_cast<char *>(file.data()), size);
+
+		// not kept as the png cache, it's encoded again only if someone views it
+		png.readFileOnMem(file.data(), file.size());
+		if (png.getWidth() != Chunk::size || png.getHeight() != Chunk::size) {
+			throw std::runtime_error("Chunk png has the wrong size");
+		}
+
+		data.allocate(bgClr);
+		for (u32 y = 0; y < Chunk::size; y++) {
+			for (u32 x = 0; x < Chunk::size; x++) {
+				data.set(x, y, png.getPixel(x, y));
+			}
+		}
 
-		data.readFileOnMem(pngCache.data(), pngCache.size());
 		if (!readerCalled) {
 			protectionData.fill(0);
 			protectionDataEmpty = true;
 		}
 	} else {
-		data.allocate(Chunk::size, Chunk::size, ws.getBackgroundColor());
+		data.allocate(bgClr);
 		protectionData.fill(0);
 		protectionDataEmpty = true;
 	}
 
-	preventUnloading(false);
+	loaded.store(true, std::memory_order_release);
+}
+
+bool Chunk::isLoaded() const {
+	return loaded.load(std::memory_order_acquire);
 }
 
 Chunk::~Chunk() {
+	if (!isLoaded()) {
+		return;
+	}
+
 	if (isChunkEmpty()) {
-		std::string fpath(ws.getChunkFilePath(x, y));
-		if (std::remove(fpath.c_str())) {
-			std::string s("Couldn't delete chunk file (" + fpath + ")");
-			std::perror(s.c_str());
+		// nothing to delete if it was never saved
+		if (ws.isChunkOnDisk(x, y) == C_NONE) {
+			return;
+		}
+
+		try {
+			ws.getRegionCache().erase(x, y);
+		} catch (const std::runtime_error& e) {
+			std::cerr << "Error while deleting chunk: " << e.what() << std::endl;
+		}
+
+		if (legacyFile) {
+			removeChunkFile(ws.getChunkFilePath(x, y, C_RAW));
+			removeChunkFile(ws.getChunkFilePath(x, y, C_PNG));
 		}
 
+		ws.setChunkOnDisk(x, y, C_NONE);
 		return;
 	}
 
@@ -106,19 +221,38 @@ Chunk::~Chunk() {
 		save();
 	} catch (const std::runtime_error& e) {
 		std::cerr << "Error while saving chunk: " << e.what() << std::endl;
+		// keep the logged pixels, to replay them on the next load
+		ws.getPixelLog().chunkSaveFailed();
 	}
 }
 
+Chunk::Pos Chunk::getX() const {
+	return x;
+}
+
+Chunk::Pos Chunk::getY() const {
+	return y;
+}
+
+RGB_u Chunk::getPixel(u16 x, u16 y) const {
+	return data.get(x & (Chunk::size - 1), y & (Chunk::size - 1));
+}
+
+// call from the main thread, the copy can then be read from anywhere
+std::vector<u8> Chunk::getRgb() const {
+	std::vector<u8> rgb(Chunk::size * Chunk::size * 3);
+	data.copyRows(rgb.data(), 0, Chunk::size);
+	return rgb;
+}
+
 bool Chunk::setPixel(u16 x, u16 y, RGB_u clr) {
 	x &= Chunk::size - 1;
 	y &= Chunk::size - 1;
 
-	if (data.getPixel(x, y).rgb != clr.rgb) {
+	if (data.set(x, y, clr)) {
 		updateLastActionTime();
-#warning "Fix possible concurrent access"
-		data.setPixel(x, y, clr); // XXX: possible concurrent access... must be looked at
-		pngFileOutdated = true;
-		pngCacheOutdated = true;
+		dirtyPngBands.set(y >> pngBandShift);
+		changed();
 		return true;
 	}
 
@@ -130,8 +264,7 @@ void Chunk::setProtectionGid(ProtPos x, ProtPos y, u32 gid) {
 	x &= Chunk::pc - 1;
 	y &= Chunk::pc - 1;
 
-	pngFileOutdated = true;
-	pngCacheOutdated = true;
+	changed();
 
 	std::unique_lock<std::shared_timed_mutex> _(sm);
 	protectionDataEmpty = false;
@@ -146,42 +279,300 @@ u32 Chunk::getProtectionGid(ProtPos x, ProtPos y) const {
 	return protectionData[y * Chunk::pc + x];
 }
 
+u64 Chunk::getVersion() const {
+	return version;
+}
+
 bool Chunk::isPngCacheOutdated() const {
-	return pngCacheOutdated;
+	return pngCacheVersion != version;
+}
+
+// call from the main thread, before queueing updatePngCache. the worker only
+// reads the copy, so painting can go on while the png is encoded
+std::shared_ptr<const Chunk::PngSnapshot> Chunk::takePngSnapshot() {
+	static constexpr sz_t bandBytes = (Chunk::size * 3) << pngBandShift;
+
+	auto snap(std::make_shared<PngSnapshot>());
+	snap->bands = dirtyPngBands;
+	snap->rgb.resize(dirtyPngBands.count() * bandBytes);
+	u8 * out = snap->rgb.data();
+	for (u32 i = 0; i < pngBandCount; i++) {
+		if (dirtyPngBands[i]) {
+			data.copyRows(out, i << pngBandShift, (i + 1) << pngBandShift);
+			out += bandBytes;
+		}
+	}
+
+	snap->prot = compressProtections();
+	dirtyPngBands.reset();
+	return snap;
 }
 
-void Chunk::unsetCacheOutdatedFlag() {
-	pngCacheOutdated = false;
+// only the dirty bands are compressed again, the rest are copied as they are.
+// only one encode per chunk can be running at a time
+void Chunk::updatePngCache(const PngSnapshot& snap) {
+	static constexpr u8 signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'};
+	static constexpr uLong bandSize = (1 << pngBandShift) * (1 + Chunk::size * 3);
+	static constexpr sz_t bandBytes = (Chunk::size * 3) << pngBandShift;
+
+	sz_t idatSize = 0;
+	const u8 * rgb = snap.rgb.data();
+	for (u32 i = 0; i < pngBandCount; i++) {
+		if (snap.bands[i]) {
+			encodePngBand(i, rgb);
+			rgb += bandBytes;
+		}
+
+		idatSize += pngBands[i].deflated.size();
+	}
+
+	pngCache.clear();
+	pngCache.reserve(sizeof(signature) + 25 + (snap.prot.size() + 12) + (idatSize + 18) + 12);
+	pngCache.insert(pngCache.end(), signature, signature + sizeof(signature));
+
+	sz_t start = beginPngChunk(pngCache, "IHDR");
+	putU32Be(pngCache, Chunk::size);
+	putU32Be(pngCache, Chunk::size);
+	pngCache.insert(pngCache.end(), {8, 2, 0, 0, 0}); // 8 bit rgb, no interlacing
+	endPngChunk(pngCache, start);
+
+	// don't write protection data if it's all 0
+	if (!snap.prot.empty()) {
+		start = beginPngChunk(pngCache, "woPp");
+		pngCache.insert(pngCache.end(), snap.prot.begin(), snap.prot.end());
+		endPngChunk(pngCache, start);
+	}
+
+	// one zlib stream, made of all the bands and an empty final block
+	start = beginPngChunk(pngCache, "IDAT");
+	pngCache.insert(pngCache.end(), {0x78, 0x01});
+	uLong adler = adler32(0, nullptr, 0);
+	for (const auto& band : pngBands) {
+		pngCache.insert(pngCache.end(), band.deflated.begin(), band.deflated.end());
+		adler = adler32_combine(adler, band.adler, bandSize);
+	}
+
+	pngCache.insert(pngCache.end(), {0x03, 0x00});
+	putU32Be(pngCache, adler);
+	endPngChunk(pngCache, start);
+
+	start = beginPngChunk(pngCache, "IEND");
+	endPngChunk(pngCache, start);
 }
 
-void Chunk::updatePngCache() {
-	data.writeFileOnMem(pngCache);
-	// pngCacheOutdated = false;
+// call from the main thread with the version the encoding started at,
+// if the chunk was modified while encoding, the cache stays outdated
+void Chunk::pngCacheUpdated(u64 encodedVersion) {
+	pngCacheVersion = encodedVersion;
+	pngEtag = "\"" + n2hexstr(encodedVersion) + "\"";
+	pngMemory = pngCache.capacity();
+	for (const auto& b : pngBands) {
+		pngMemory += b.deflated.capacity();
+	}
 }
 
 const std::vector<u8>& Chunk::getPngData() const {
 	return pngCache;
 }
 
+const std::string& Chunk::getPngEtag() const {
+	return pngEtag;
+}
+
+sz_t Chunk::dropPngCache() {
+	sz_t freed = pngMemory;
+	std::vector<u8>().swap(pngCache);
+	for (auto& b : pngBands) {
+		std::vector<u8>().swap(b.deflated);
+	}
+
+	dirtyPngBands.set();
+	pngCacheVersion = 0;
+	pngEtag.clear();
+	pngMemory = 0;
+	return freed;
+}
+
+// saves right away, also if a snapshot of this chunk is being written
 bool Chunk::save() {
-	if (pngFileOutdated) {
-		std::string fpath(ws.getChunkFilePath(x, y));
-		if (pngCacheOutdated) {
-			data.writeFile(fpath);
-		} else {
-			std::ofstream f(fpath, std::ios::out | std::ios::binary | std::ios::trunc);
-			if (!f) {
-				throw std::runtime_error("Couldn't open file: " + fpath);
+	if (!pngFileOutdated && !saving) {
+		return false;
+	}
+
+	auto snap(snapshot());
+	try {
+		writeSnapshot(ws.getRegionCache(), *snap);
+	} catch (...) {
+		snapshotSaved(false);
+		throw;
+	}
+
+	snapshotSaved(true);
+	return true;
+}
+
+// call from the main thread, the chunk is not dirty until it changes again.
+// paletted chunks only copy their indices here
+std::shared_ptr<Chunk::Snapshot> Chunk::snapshot() {
+	auto snap(std::make_shared<Snapshot>(Snapshot{x, y, data, compressProtections()}));
+	pngFileOutdated = false;
+	saving = true;
+	return snap;
+}
+
+// can be called from any thread, returns the amount of bytes written
+sz_t Chunk::writeSnapshot(RegionCache& regions, const Snapshot& snap) {
+	std::vector<u8> file(encodeRaw(snap));
+	regions.write(snap.x, snap.y, file);
+	return file.size();
+}
+
+// call from the main thread when the snapshot was written, or failed to
+void Chunk::snapshotSaved(bool ok) {
+	saving = false;
+	if (!ok) {
+		pngFileOutdated = true;
+		return;
+	}
+
+	ws.setChunkOnDisk(x, y, C_REGION);
+	if (legacyFile) {
+		removeChunkFile(ws.getChunkFilePath(x, y, C_RAW));
+		removeChunkFile(ws.getChunkFilePath(x, y, C_PNG));
+		legacyFile = false;
+	}
+}
+
+void Chunk::changed() {
+	version++;
+	pngFileOutdated = true;
+}
+
+std::vector<u8> Chunk::compressProtections() const {
+	if (protectionDataEmpty) {
+		return {};
+	}
+
+	std::shared_lock<std::shared_timed_mutex> _(sm);
+	auto prot(rle::compress(protectionData.data(), protectionData.size()));
+	return std::vector<u8>(prot.first.get(), prot.first.get() + prot.second);
+}
+
+// rgb points to the rows of the band, copied by takePngSnapshot
+void Chunk::encodePngBand(u32 band, const u8 * rgb) {
+	static constexpr sz_t rowSize = 1 + Chunk::size * 3;
+	std::vector<u8> rows(rowSize << pngBandShift);
+	u8 * p = rows.data();
+	for (u32 y = 0; y < 1u << pngBandShift; y++) {
+		*p++ = 1; // sub filter, flat colors become runs of zeros
+		for (u32 i = 0; i < 3; i++) {
+			*p++ = *rgb++;
+		}
+
+		for (u32 i = 3; i < Chunk::size * 3; i++) {
+			*p++ = rgb[0] - rgb[-3];
+			rgb++;
+		}
+	}
+
+	PngBand& b = pngBands[band];
+	z_stream zs{};
+	if (deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+		throw std::runtime_error("Couldn't init deflate for the chunk png");
+	}
+
+	b.deflated.resize(deflateBound(&zs, rows.size()) + 16);
+	zs.next_in = rows.data();
+	zs.avail_in = rows.size();
+	zs.next_out = b.deflated.data();
+	zs.avail_out = b.deflated.size();
+
+	// sync flush ends the band byte aligned, without marking it as the last block
+	int err = deflate(&zs, Z_SYNC_FLUSH);
+	b.deflated.resize(b.deflated.size() - zs.avail_out);
+	deflateEnd(&zs);
+	if (err != Z_OK || zs.avail_in != 0) {
+		throw std::runtime_error("Couldn't compress chunk png band");
+	}
+
+	b.deflated.shrink_to_fit();
+	b.adler = adler32(adler32(0, nullptr, 0), rows.data(), rows.size());
+}
+
+void Chunk::readRaw(const u8 * buf, sz_t size, RGB_u bgClr) {
+	RawChunkHeader hdr;
+	if (size < sizeof(hdr)) {
+		throw std::runtime_error("Raw chunk file too small");
+	}
+
+	std::memcpy(&hdr, buf, sizeof(hdr));
+	if (std::memcmp(hdr.magic, rawChunkMagic, sizeof(hdr.magic)) != 0 || hdr.version != 1
+			|| hdr.width != Chunk::size || hdr.height != Chunk::size
+			|| sizeof(hdr) + u64(hdr.protSize) + hdr.pixelsSize > size) {
+		throw std::runtime_error("Invalid raw chunk file header");
+	}
+
+	buf += sizeof(hdr);
+
+	protectionData.fill(0);
+	protectionDataEmpty = hdr.protSize == 0;
+	if (!protectionDataEmpty) {
+		try {
+			if (rle::getItems<u32>(buf, hdr.protSize) != protectionData.size()) {
+				throw std::length_error("wrong item count");
 			}
 
-			f.write(reinterpret_cast<char *>(pngCache.data()), pngCache.size());
+			rle::decompress(buf, hdr.protSize, protectionData.data(), protectionData.size());
+		} catch (const std::length_error& e) {
+			std::cerr << "Protection data corrupted for chunk "
+			          << x << ", " << y << ". Resetting." << std::endl;
+			protectionData.fill(0);
+			pngFileOutdated = true;
+			protectionDataEmpty = true;
 		}
 
-		pngFileOutdated = false;
-		return true;
+		buf += hdr.protSize;
 	}
 
-	return false;
+	uLongf rgbSize = Chunk::size * Chunk::size * 3;
+	auto rgb(std::make_unique<u8[]>(rgbSize));
+	if (uncompress(rgb.get(), &rgbSize, buf, hdr.pixelsSize) != Z_OK
+			|| rgbSize != Chunk::size * Chunk::size * 3) {
+		throw std::runtime_error("Couldn't decompress raw chunk pixels");
+	}
+
+	data.assign(rgb.get(), bgClr);
+}
+
+std::vector<u8> Chunk::encodeRaw(const Snapshot& snap) {
+	const uLong rgbSize = ChunkPixels::totalBytes;
+	auto rgb(std::make_unique<u8[]>(rgbSize));
+	snap.pixels.copyRows(rgb.get(), 0, Chunk::size);
+
+	RawChunkHeader hdr;
+	std::memcpy(hdr.magic, rawChunkMagic, sizeof(hdr.magic));
+	hdr.version = 1;
+	std::memset(hdr.reserved, 0, sizeof(hdr.reserved));
+	hdr.width = Chunk::size;
+	hdr.height = Chunk::size;
+	hdr.protSize = snap.prot.size();
+
+	uLongf pixelsSize = compressBound(rgbSize);
+	std::vector<u8> file(sizeof(hdr) + snap.prot.size() + pixelsSize);
+	u8 * const pixels = file.data() + sizeof(hdr) + snap.prot.size();
+	// speed over size, these get saved often
+	if (compress2(pixels, &pixelsSize, rgb.get(), rgbSize, Z_BEST_SPEED) != Z_OK) {
+		throw std::runtime_error("Couldn't compress chunk pixels");
+	}
+
+	hdr.pixelsSize = pixelsSize;
+	std::memcpy(file.data(), &hdr, sizeof(hdr));
+	if (!snap.prot.empty()) {
+		std::memcpy(file.data() + sizeof(hdr), snap.prot.data(), snap.prot.size());
+	}
+
+	file.resize(sizeof(hdr) + snap.prot.size() + pixelsSize);
+	return file;
 }
 
 void Chunk::updateLastActionTime() {
@@ -192,16 +583,37 @@ std::chrono::steady_clock::time_point Chunk::getLastActionTime() const {
 	return lastAction;
 }
 
+// true if there are changes that weren't written to disk
+bool Chunk::isDirty() const {
+	return pngFileOutdated;
+}
+
+bool Chunk::isSaving() const {
+	return saving;
+}
+
+sz_t Chunk::getMemoryUsage() const {
+	return sizeof(Chunk) + data.getMemoryUsage();
+}
+
+sz_t Chunk::getPngMemoryUsage() const {
+	return pngMemory;
+}
+
 bool Chunk::shouldUnload(bool ignoreTime) const {
-	return canUnload && (ignoreTime || std::chrono::steady_clock::now() - lastAction > std::chrono::minutes(1));
+	return unloadLocks == 0 && (ignoreTime || std::chrono::steady_clock::now() - lastAction > std::chrono::minutes(1));
 }
 
 void Chunk::preventUnloading(bool state) {
-	canUnload = !state;
+	// nested calls are fine, as long as each true is paired with a false
+	if (state) {
+		unloadLocks++;
+	} else if (unloadLocks > 0) {
+		unloadLocks--;
+	}
 }
 
 bool Chunk::isChunkEmpty() {
-	// very slow
 	for (u32 i = 0; i < protectionData.size(); i++) {
 		if (protectionData[i] != 0) {
 			return false;
@@ -210,18 +622,9 @@ bool Chunk::isChunkEmpty() {
 
 	if (!protectionDataEmpty) {
 		protectionDataEmpty = true;
-		pngCacheOutdated = true;
-		pngFileOutdated = true;
-	}
-
-	RGB_u bgclr = ws.getBackgroundColor();
-	for (u32 y = 0; y < data.getHeight(); y++) {
-		for (u32 x = 0; x < data.getWidth(); x++) {
-			if (data.getPixel(x, y).rgb != bgclr.rgb) {
-				return false;
-			}
-		}
+		changed();
 	}
 
-	return true;
+	data.setBackground(ws.getBackgroundColor());
+	return data.getNonBackgroundCount() == 0;
 }
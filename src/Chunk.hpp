@@ -6,20 +6,24 @@
 #include <chrono>
 #include <shared_mutex>
 #include <bitset>
+#include <atomic>
+#include <string>
+#include <memory>
 
 #include <explints.hpp>
 #include <color.hpp>
-#include <PngImage.hpp>
+#include <ChunkPixels.hpp>
 #include <utils.hpp>
 
 class WorldStorage;
+class RegionCache;
 
 class Chunk {
 public:
 	using Pos = i32;
 	using ProtPos = i32;
 
-	static constexpr sz_t size = 512;
+	static constexpr sz_t size = ChunkPixels::side;
 	static constexpr sz_t protectionAreaSize = 16;
 
 	// pc**2 = dimensions of the protection array for chunks
@@ -29,42 +33,105 @@ public:
 	static constexpr u32 pSizeShift  = popc(protectionAreaSize - 1);
 	static constexpr u32 posShift = popc(size - 1);
 
+	// the png is compressed in bands of rows, so that only the changed ones
+	// have to be compressed again
+	static constexpr u32 pngBandShift = 5;
+	static constexpr sz_t pngBandCount = size >> pngBandShift;
+	using PngBandSet = std::bitset<pngBandCount>;
+
+	// copy of what gets saved, so it can be written by another thread.
+	// the pixels are expanded to rgb and compressed there
+	struct Snapshot {
+		Pos x;
+		Pos y;
+		ChunkPixels pixels;
+		std::vector<u8> prot; // rle, empty if there are no protections
+	};
+
+	// rows of the bands that changed, copied so the png can be encoded by another thread
+	struct PngSnapshot {
+		PngBandSet bands;
+		std::vector<u8> rgb; // rows of the set bands, in order
+		std::vector<u8> prot; // rle, empty if there are no protections
+	};
+
 private:
+	struct PngBand {
+		std::vector<u8> deflated; // raw deflate, ends byte aligned
+		u32 adler;
+	};
+
 	mutable std::shared_timed_mutex sm;
 	std::chrono::steady_clock::time_point lastAction;
 	const Pos x;
 	const Pos y;
-	const WorldStorage& ws;
-	PngImage data;
+	WorldStorage& ws;
+	ChunkPixels data;
 	std::array<u32, pc * pc> protectionData; // split one chunk to protection cells
 	// with specific per-world, or general uvias roles
-	std::vector<u8> pngCache; // could get big
-	bool canUnload;
+	std::vector<u8> pngCache; // could get big. written by the encoding thread, read and freed by the main thread between encodes
+	sz_t pngMemory; // size of the png buffers, as of the last finished encode
+	std::string pngEtag; // of the current pngCache, reused for every request
+	std::array<PngBand, pngBandCount> pngBands;
+	PngBandSet dirtyPngBands;
+	u64 version; // bumped on every visible change, starts at the load time
+	u64 pngCacheVersion; // version that pngCache was encoded from
+	u32 unloadLocks; // can't unload while something is using the chunk
 	bool protectionDataEmpty; // only set to true if woPp chunk reader wasn't called
-	bool pngCacheOutdated;
 	bool pngFileOutdated;
+	bool saving; // a snapshot is being written
+	bool legacyFile; // loaded from a per-chunk file, instead of a region
+	std::atomic<bool> loaded;
 
 public:
-	Chunk(Pos x, Pos y, const WorldStorage& ws);
+	Chunk(Pos x, Pos y, WorldStorage& ws);
 	~Chunk();
 
+	void load(RGB_u bgClr);
+	bool isLoaded() const;
+
+	Pos getX() const;
+	Pos getY() const;
+
+	RGB_u getPixel(u16 x, u16 y) const;
+	std::vector<u8> getRgb() const; // packed rgb rows, for other threads
 	bool setPixel(u16 x, u16 y, RGB_u);
 
 	void setProtectionGid(ProtPos x, ProtPos y, u32 gid);
 	u32 getProtectionGid(ProtPos x, ProtPos y) const;
 
+	u64 getVersion() const;
 	bool isPngCacheOutdated() const;
-	void unsetCacheOutdatedFlag();
-	void updatePngCache();
+	std::shared_ptr<const PngSnapshot> takePngSnapshot();
+	void updatePngCache(const PngSnapshot&);
+	void pngCacheUpdated(u64 encodedVersion);
 	const std::vector<u8>& getPngData() const;
+	const std::string& getPngEtag() const;
+	// frees the png, it's encoded again when requested. don't call while encoding
+	sz_t dropPngCache();
 
 	bool save();
+	std::shared_ptr<Snapshot> snapshot();
+	static sz_t writeSnapshot(RegionCache&, const Snapshot&);
+	void snapshotSaved(bool ok);
 
 	void updateLastActionTime();
 	std::chrono::steady_clock::time_point getLastActionTime() const;
 
+	bool isDirty() const;
+	bool isSaving() const;
+	sz_t getMemoryUsage() const; // without the png, see getPngMemoryUsage
+	sz_t getPngMemoryUsage() const;
+
 	bool shouldUnload(bool) const;
 	void preventUnloading(bool);
 
 	bool isChunkEmpty();
+
+private:
+	void changed();
+	std::vector<u8> compressProtections() const;
+	void encodePngBand(u32 band, const u8 * rgb);
+	void readRaw(const u8 * buf, sz_t size, RGB_u bgClr);
+	static std::vector<u8> encodeRaw(const Snapshot&);
 };
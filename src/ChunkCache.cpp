@@ -0,0 +1,66 @@
+#include "ChunkCache.hpp"
+
+#include <nlohmann/json.hpp>
+
+ChunkCache::ChunkCache(u64 budget, u64 pngBudget)
+: budget(budget),
+  used(0),
+  hits(0),
+  misses(0),
+  evictions(0),
+  pngBudget(pngBudget),
+  pngUsed(0),
+  pngDrops(0) { }
+
+void ChunkCache::hit()        { ++hits; }
+void ChunkCache::miss()       { ++misses; }
+void ChunkCache::evicted()    { ++evictions; }
+void ChunkCache::pngDropped() { ++pngDrops; }
+
+void ChunkCache::setUsedBytes(u64 b) {
+	used = b;
+}
+
+void ChunkCache::setBudget(u64 b) {
+	budget = b;
+}
+
+void ChunkCache::setPngUsedBytes(u64 b) {
+	pngUsed = b;
+}
+
+void ChunkCache::setPngBudget(u64 b) {
+	pngBudget = b;
+}
+
+u64 ChunkCache::getBudget()       const { return budget; }
+u64 ChunkCache::getUsedBytes()    const { return used; }
+u64 ChunkCache::getHits()         const { return hits; }
+u64 ChunkCache::getMisses()       const { return misses; }
+u64 ChunkCache::getEvictions()    const { return evictions; }
+u64 ChunkCache::getPngBudget()    const { return pngBudget; }
+u64 ChunkCache::getPngUsedBytes() const { return pngUsed; }
+u64 ChunkCache::getPngDrops()     const { return pngDrops; }
+
+bool ChunkCache::isOverBudget() const {
+	return used > budget;
+}
+
+bool ChunkCache::isPngOverBudget() const {
+	return pngUsed > pngBudget;
+}
+
+void to_json(nlohmann::json& j, const ChunkCache& c) {
+	j = {
+		{ "budget", c.getBudget() },
+		{ "used", c.getUsedBytes() },
+		{ "hits", c.getHits() },
+		{ "misses", c.getMisses() },
+		{ "evictions", c.getEvictions() },
+		{ "png", {
+			{ "budget", c.getPngBudget() },
+			{ "used", c.getPngUsedBytes() },
+			{ "drops", c.getPngDrops() }
+		}}
+	};
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <chrono>
+
+#include <explints.hpp>
+
+#include <nlohmann/json_fwd.hpp>
+
+class World;
+
+struct EvictableChunk {
+	std::chrono::steady_clock::time_point lastAction;
+	World * world;
+	u64 key;
+};
+
+// Memory budget and stats of the chunks loaded on every world,
+// WorldManager evicts the least recently used chunks when it's exceeded.
+// The encoded pngs of the chunks have their own budget, and are dropped
+// before the chunks themselves
+class ChunkCache {
+	u64 budget; // bytes
+	u64 used;
+	u64 hits;
+	u64 misses;
+	u64 evictions;
+	u64 pngBudget;
+	u64 pngUsed;
+	u64 pngDrops;
+
+public:
+	ChunkCache(u64 budget, u64 pngBudget);
+
+	void hit();
+	void miss();
+	void evicted();
+	void pngDropped();
+
+	void setUsedBytes(u64);
+	void setBudget(u64);
+	void setPngUsedBytes(u64);
+	void setPngBudget(u64);
+
+	u64 getBudget() const;
+	u64 getUsedBytes() const;
+	u64 getHits() const;
+	u64 getMisses() const;
+	u64 getEvictions() const;
+	u64 getPngBudget() const;
+	u64 getPngUsedBytes() const;
+	u64 getPngDrops() const;
+
+	bool isOverBudget() const;
+	bool isPngOverBudget() const;
+};
+
+void to_json(nlohmann::json&, const ChunkCache&);
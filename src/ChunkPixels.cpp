@@ -0,0 +1,246 @@
+#include "ChunkPixels.hpp"
+
+#include <cstring>
+#include <algorithm>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+static constexpr sz_t pixelCount = ChunkPixels::side * ChunkPixels::side;
+
+static sz_t indexBytes(u8 bits) {
+	return pixelCount * bits / 8;
+}
+
+ChunkPixels::ChunkPixels()
+: bits(0),
+  lastIndex(0),
+  nonBg(0) {
+	bg.rgb = 0;
+}
+
+ChunkPixels::ChunkPixels(const ChunkPixels& o)
+: palette(o.palette),
+  bits(o.bits),
+  lastIndex(o.lastIndex),
+  bg(o.bg),
+  nonBg(o.nonBg) {
+	if (o.px) {
+		sz_t size = palette.empty() ? totalBytes : indexBytes(bits);
+		px = std::make_unique<u8[]>(size);
+		std::memcpy(px.get(), o.px.get(), size);
+	}
+}
+
+void ChunkPixels::allocate(RGB_u bg) {
+	// one color, every index is 0
+	px = std::make_unique<u8[]>(indexBytes(1));
+	palette.assign(1, key(bg));
+	bits = 1;
+	lastIndex = 0;
+	this->bg = bg;
+	nonBg = 0;
+}
+
+void ChunkPixels::assign(const u8 * rgb, RGB_u bg) {
+	this->bg = bg;
+	palette.clear();
+	lastIndex = 0;
+
+	auto indices(std::make_unique<u8[]>(pixelCount));
+	for (sz_t i = 0; i < pixelCount; i++) {
+		const u8 * p = rgb + i * 3;
+		u32 k = p[0] | p[1] << 8 | p[2] << 16;
+		if (palette.empty() || palette[lastIndex] != k) {
+			auto it = std::find(palette.begin(), palette.end(), k);
+			if (it == palette.end()) {
+				if (palette.size() == maxPaletteSize) {
+					// too many colors, keep it as rgb
+					palette.clear();
+					px = std::make_unique<u8[]>(totalBytes);
+					std::memcpy(px.get(), rgb, totalBytes);
+					bits = 0;
+					nonBg = countNotEqualRgb(bg);
+					return;
+				}
+
+				it = palette.insert(it, k);
+			}
+
+			lastIndex = it - palette.begin();
+		}
+
+		indices[i] = lastIndex;
+	}
+
+	bits = 1;
+	while (palette.size() > 1u << bits) {
+		bits *= 2;
+	}
+
+	px = std::make_unique<u8[]>(indexBytes(bits));
+	for (sz_t i = 0; i < pixelCount; i++) {
+		setIndex(i, indices[i]);
+	}
+
+	nonBg = countNotEqual(bg);
+}
+
+bool ChunkPixels::isAllocated() const {
+	return px != nullptr;
+}
+
+bool ChunkPixels::isPaletted() const {
+	return !palette.empty();
+}
+
+void ChunkPixels::copyRows(u8 * out, u32 fromY, u32 toY) const {
+	if (palette.empty()) {
+		std::memcpy(out, px.get() + fromY * rowBytes, (toY - fromY) * rowBytes);
+		return;
+	}
+
+	for (u32 pos = fromY * side; pos < toY * side; pos++) {
+		u32 k = palette[getIndex(pos)];
+		out[0] = k;
+		out[1] = k >> 8;
+		out[2] = k >> 16;
+		out += 3;
+	}
+}
+
+void ChunkPixels::setBackground(RGB_u clr) {
+	if (!isBg(clr)) {
+		bg = clr;
+		nonBg = countNotEqual(clr);
+	}
+}
+
+u32 ChunkPixels::getNonBackgroundCount() const {
+	return nonBg;
+}
+
+u32 ChunkPixels::countNotEqual(RGB_u clr) const {
+	if (palette.empty()) {
+		return countNotEqualRgb(clr);
+	}
+
+	auto it = std::find(palette.begin(), palette.end(), key(clr));
+	if (it == palette.end()) {
+		return pixelCount;
+	}
+
+	u32 i = it - palette.begin();
+	u32 count = 0;
+	for (u32 pos = 0; pos < pixelCount; pos++) {
+		count += getIndex(pos) != i;
+	}
+
+	return count;
+}
+
+sz_t ChunkPixels::getMemoryUsage() const {
+	if (!px) {
+		return 0;
+	}
+
+	return palette.empty() ? totalBytes : indexBytes(bits) + palette.capacity() * sizeof(u32);
+}
+
+bool ChunkPixels::setPaletted(u32 pos, RGB_u clr) {
+	u32 k = key(clr);
+	u32 old = palette[getIndex(pos)];
+	if (old == k) {
+		return false;
+	}
+
+	u32 i = palette[lastIndex] == k ? lastIndex : findOrAddColor(k);
+	if (palette.empty()) {
+		// the palette overflowed
+		return set(pos % side, pos / side, clr);
+	}
+
+	nonBg += isBg(toRgb(old)) - isBg(clr);
+	setIndex(pos, i);
+	lastIndex = i;
+	return true;
+}
+
+// colors are never removed from the palette until the chunk is loaded again
+u32 ChunkPixels::findOrAddColor(u32 k) {
+	auto it = std::find(palette.begin(), palette.end(), k);
+	if (it != palette.end()) {
+		return it - palette.begin();
+	}
+
+	if (palette.size() == 1u << bits) {
+		if (bits == 8) {
+			promoteToRgb();
+			return 0;
+		}
+
+		repack(bits * 2);
+	}
+
+	palette.push_back(k);
+	return palette.size() - 1;
+}
+
+void ChunkPixels::repack(u8 newBits) {
+	std::unique_ptr<u8[]> old(std::move(px));
+	px = std::make_unique<u8[]>(indexBytes(newBits));
+	for (u32 pos = 0; pos < pixelCount; pos++) {
+		u32 from = pos * bits;
+		u32 to = pos * newBits;
+		px[to >> 3] |= (old[from >> 3] >> (from & 7) & ((1 << bits) - 1)) << (to & 7);
+	}
+
+	bits = newBits;
+}
+
+void ChunkPixels::promoteToRgb() {
+	auto rgb(std::make_unique<u8[]>(totalBytes));
+	copyRows(rgb.get(), 0, side);
+	px = std::move(rgb);
+	palette.clear();
+	palette.shrink_to_fit();
+	bits = 0;
+}
+
+u32 ChunkPixels::countNotEqualRgb(RGB_u clr) const {
+	const u8 * p = px.get();
+	u32 count = 0;
+	sz_t i = 0;
+
+#ifdef __SSE2__
+	// 16 pixels are 3 registers, with the color repeated at the same offsets.
+	// a pixel matches if the 3 bits of its bytes in the compare mask are set
+	alignas(16) u8 pattern[48];
+	for (u32 j = 0; j < 48; j += 3) {
+		pattern[j] = clr.r;
+		pattern[j + 1] = clr.g;
+		pattern[j + 2] = clr.b;
+	}
+
+	const __m128i c0 = _mm_load_si128(reinterpret_cast<const __m128i *>(pattern));
+	const __m128i c1 = _mm_load_si128(reinterpret_cast<const __m128i *>(pattern + 16));
+	const __m128i c2 = _mm_load_si128(reinterpret_cast<const __m128i *>(pattern + 32));
+	constexpr u64 firstBytes = 0x249249249249; // every third bit, 16 times
+
+	for (; i + 48 <= totalBytes; i += 48) {
+		const __m128i * v = reinterpret_cast<const __m128i *>(p + i);
+		u64 m = u64(_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128(v), c0)))
+			| u64(_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128(v + 1), c1))) << 16
+			| u64(_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128(v + 2), c2))) << 32;
+
+		count += 16 - __builtin_popcountll(m & m >> 1 & m >> 2 & firstBytes);
+	}
+#endif
+
+	for (; i < totalBytes; i += 3) {
+		count += p[i] != clr.r || p[i + 1] != clr.g || p[i + 2] != clr.b;
+	}
+
+	return count;
+}
@@ -0,0 +1,119 @@
+#pragma once
+
+#include <memory>
+#include <vector>
+
+#include <explints.hpp>
+#include <color.hpp>
+
+// Pixels of a chunk. Chunks with few colors are stored as a palette with
+// 1, 2, 4 or 8 bit indices, widened as colors are added, and turned into
+// packed rgb rows when the palette overflows. Empty until allocated.
+// Keeps count of the pixels that differ from the background, so empty
+// checks don't scan.
+class ChunkPixels {
+public:
+	static constexpr sz_t side = 512;
+	static constexpr sz_t rowBytes = side * 3;
+	static constexpr sz_t totalBytes = side * rowBytes;
+	static constexpr u32 maxPaletteSize = 256;
+
+private:
+	std::unique_ptr<u8[]> px; // rgb rows, or the packed indices
+	std::vector<u32> palette; // empty if px is rgb, see key()
+	u8 bits; // per index
+	u8 lastIndex; // of the last color set, paints come in runs
+	RGB_u bg; // color that nonBg is counted against
+	u32 nonBg;
+
+public:
+	ChunkPixels();
+	// copies the palette and indices as they are, so the copy is cheap for
+	// paletted chunks and can be expanded by another thread
+	ChunkPixels(const ChunkPixels&);
+
+	void allocate(RGB_u bg);
+	// rgb must hold totalBytes
+	void assign(const u8 * rgb, RGB_u bg);
+	bool isAllocated() const;
+	bool isPaletted() const;
+
+	RGB_u get(u32 x, u32 y) const {
+		if (!palette.empty()) {
+			return toRgb(palette[getIndex(y * side + x)]);
+		}
+
+		const u8 * p = px.get() + (y * side + x) * 3;
+		RGB_u clr;
+		clr.r = p[0];
+		clr.g = p[1];
+		clr.b = p[2];
+		clr.a = 255;
+		return clr;
+	}
+
+	// returns false if the pixel already had this color
+	bool set(u32 x, u32 y, RGB_u clr) {
+		if (!palette.empty()) {
+			return setPaletted(y * side + x, clr);
+		}
+
+		u8 * p = px.get() + (y * side + x) * 3;
+		if (p[0] == clr.r && p[1] == clr.g && p[2] == clr.b) {
+			return false;
+		}
+
+		nonBg += isBg(p) - isBg(clr);
+		p[0] = clr.r;
+		p[1] = clr.g;
+		p[2] = clr.b;
+		return true;
+	}
+
+	// copies rows [fromY, toY) as packed rgb
+	void copyRows(u8 * out, u32 fromY, u32 toY) const;
+	// counts again if the background changed since the last call
+	void setBackground(RGB_u);
+	u32 getNonBackgroundCount() const;
+	u32 countNotEqual(RGB_u) const;
+	sz_t getMemoryUsage() const;
+
+private:
+	static u32 key(RGB_u clr) {
+		return clr.r | clr.g << 8 | clr.b << 16;
+	}
+
+	static RGB_u toRgb(u32 k) {
+		RGB_u clr;
+		clr.r = k;
+		clr.g = k >> 8;
+		clr.b = k >> 16;
+		clr.a = 255;
+		return clr;
+	}
+
+	u32 getIndex(u32 pos) const {
+		u32 bit = pos * bits;
+		return px[bit >> 3] >> (bit & 7) & ((1 << bits) - 1);
+	}
+
+	void setIndex(u32 pos, u32 i) {
+		u32 bit = pos * bits;
+		u8 mask = ((1 << bits) - 1) << (bit & 7);
+		px[bit >> 3] = (px[bit >> 3] & ~mask) | (i << (bit & 7) & mask);
+	}
+
+	bool isBg(const u8 * p) const {
+		return p[0] == bg.r && p[1] == bg.g && p[2] == bg.b;
+	}
+
+	bool isBg(RGB_u clr) const {
+		return clr.r == bg.r && clr.g == bg.g && clr.b == bg.b;
+	}
+
+	bool setPaletted(u32 pos, RGB_u);
+	u32 findOrAddColor(u32 k);
+	void repack(u8 newBits);
+	void promoteToRgb();
+	u32 countNotEqualRgb(RGB_u) const;
+};
@@ -0,0 +1,143 @@
+#include "ConnectionArgs.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+static int hexValue(char c) {
+	if (c >= '0' && c <= '9') return c - '0';
+	if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+	return -1;
+}
+
+// returns the decoded size, or -1 if the percent encoding is invalid.
+// out needs in.size() bytes at most
+static long urldecodeTo(std::string_view in, char * out) {
+	char * start = out;
+	for (sz_t i = 0; i < in.size(); i++) {
+		if (in[i] != '%') {
+			*out++ = in[i];
+			continue;
+		}
+
+		if (i + 2 >= in.size()) {
+			return -1;
+		}
+
+		int hi = hexValue(in[i + 1]);
+		int lo = hexValue(in[i + 2]);
+		if (hi < 0 || lo < 0) {
+			return -1;
+		}
+
+		*out++ = hi << 4 | lo;
+		i += 2;
+	}
+
+	return out - start;
+}
+
+ConnectionArgs::ConnectionArgs()
+: capacity(0),
+  used(0),
+  count(0) { }
+
+ConnectionArgs::Result ConnectionArgs::parse(std::string_view header, std::string_view protoName) {
+	// decoded args are never longer than the header
+	capacity = header.size() + reservedBytes;
+	buf = std::make_unique<char[]>(capacity);
+	used = 0;
+	count = 0;
+
+	bool first = true;
+	while (true) {
+		sz_t end = header.find(',');
+		std::string_view tok(header.substr(0, end));
+		while (!tok.empty() && (tok.front() == ' ' || tok.front() == '\t')) {
+			tok.remove_prefix(1);
+		}
+
+		if (first) {
+			if (tok != protoName) {
+				return Result::BAD_PROTOCOL;
+			}
+
+			first = false;
+		} else if (sz_t sep = tok.find('+'); sep != std::string_view::npos) {
+			if (count == maxArgs) {
+				return Result::MALFORMED;
+			}
+
+			std::string_view key(tok.substr(0, sep));
+			auto * arg = find(key);
+			if (!arg) {
+				// later duplicates replace the earlier ones
+				char * k = alloc(key.size());
+				std::memcpy(k, key.data(), key.size());
+				arg = &args[count++];
+				arg->first = {k, key.size()};
+			}
+
+			char * v = buf.get() + used;
+			long size = urldecodeTo(tok.substr(sep + 1), v);
+			if (size < 0) {
+				return Result::MALFORMED;
+			}
+
+			used += size;
+			arg->second = {v, sz_t(size)};
+		}
+
+		if (end == std::string_view::npos) {
+			break;
+		}
+
+		header.remove_prefix(end + 1);
+	}
+
+	return Result::OK;
+}
+
+std::optional<std::string_view> ConnectionArgs::get(std::string_view key) const {
+	for (sz_t i = 0; i < count; i++) {
+		if (args[i].first == key) {
+			return args[i].second;
+		}
+	}
+
+	return std::nullopt;
+}
+
+bool ConnectionArgs::set(std::string_view key, std::string_view value) {
+	auto * arg = find(key);
+	if ((!arg && count == maxArgs) || used + key.size() + value.size() > capacity) {
+		return false;
+	}
+
+	if (!arg) {
+		char * k = alloc(key.size());
+		std::memcpy(k, key.data(), key.size());
+		arg = &args[count++];
+		arg->first = {k, key.size()};
+	}
+
+	char * v = alloc(value.size());
+	std::memcpy(v, value.data(), value.size());
+	arg->second = {v, value.size()};
+	return true;
+}
+
+std::pair<std::string_view, std::string_view> * ConnectionArgs::find(std::string_view key) {
+	auto end = args.begin() + count;
+	auto it = std::find_if(args.begin(), end, [key] (const auto& arg) {
+		return arg.first == key;
+	});
+
+	return it != end ? &*it : nullptr;
+}
+
+char * ConnectionArgs::alloc(sz_t size) {
+	char * p = buf.get() + used;
+	used += size;
+	return p;
+}
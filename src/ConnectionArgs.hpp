@@ -0,0 +1,46 @@
+#pragma once
+
+#include <array>
+#include <memory>
+#include <optional>
+#include <string_view>
+#include <utility>
+
+#include <explints.hpp>
+
+// Arguments of a connection, sent in the sec-websocket-protocol header as
+// "proto, key+value, ...", with url encoded values. Keys and decoded values
+// are stored in one buffer, allocated once, so parsing doesn't allocate
+// per argument.
+class ConnectionArgs {
+public:
+	static constexpr sz_t maxArgs = 8;
+	// room kept for values set after parsing, like the session token
+	static constexpr sz_t reservedBytes = 64;
+
+	enum class Result {
+		OK,
+		BAD_PROTOCOL, // first value isn't the protocol name
+		MALFORMED // bad encoding, or too many args
+	};
+
+private:
+	std::unique_ptr<char[]> buf;
+	sz_t capacity;
+	sz_t used;
+	std::array<std::pair<std::string_view, std::string_view>, maxArgs> args;
+	sz_t count;
+
+public:
+	ConnectionArgs();
+
+	Result parse(std::string_view header, std::string_view protoName);
+
+	std::optional<std::string_view> get(std::string_view key) const;
+	// copies key and value, returns false if there's no room left
+	bool set(std::string_view key, std::string_view value);
+
+private:
+	std::pair<std::string_view, std::string_view> * find(std::string_view key);
+	char * alloc(sz_t size);
+};
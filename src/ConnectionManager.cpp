@@ -25,38 +25,6 @@ ConnectionManager::ConnectionManager(uWS::Hub& h, std::string protoName)
 : defaultGroup(h.getDefaultGroup<uWS::SERVER>()) {
 	h.onConnection([this, pn{std::move(protoName)}] (uWS::WebSocket<uWS::SERVER> * ws, uWS::HttpRequest req) {
 		HttpData hd(&req);
-		// Maybe this could be moved on the upgrade handler, somehow
-		auto argHead = hd.getHeader("sec-websocket-protocol");
-		if (!argHead) {
-			ws->close(4000);
-			return;
-		}
-
-		auto args(tokenize(*argHead, ','));
-		std::map<std::string, std::string> argList;
-
-		if (args.size() == 0 || args[0] != pn) {
-			ws->close(4001);
-			return;
-		}
-
-		for (auto& s : args) {
-			ltrim_v(s);
-			sz_t sep = s.find_first_of('+');
-			if (sep != std::string_view::npos) {
-				std::string str(s.substr(sep + 1));
-
-				try {
-					urldecode(str);
-				} catch (const std::exception& e) {
-					ws->close(4002);
-					return;
-				}
-
-				argList.emplace(std::string(s.substr(0, sep)), std::move(str));
-			}
-		}
-
 		auto addr = ws->getAddress();
 		Ip ip;
 		if (addr.family[0] == 'U'
@@ -74,22 +42,53 @@ ConnectionManager::ConnectionManager(uWS::Hub& h, std::string protoName)
 			ip = Ip(addr.address);
 		}
 
-		handleIncoming(ws, std::move(argList), hd, ip);
+		// rate limits, before the arguments are parsed and the connection is tracked
+		for (auto& p : processors) {
+			if (!p->admit(ip)) {
+				AuthError::one(ws, typeid(*p.get()));
+				ws->close(4004);
+				return;
+			}
+		}
+
+		// Maybe this could be moved on the upgrade handler, somehow
+		auto argHead = hd.getHeader("sec-websocket-protocol");
+		if (!argHead) {
+			ws->close(4000);
+			return;
+		}
+
+		ConnectionArgs args;
+		switch (args.parse(*argHead, pn)) {
+			case ConnectionArgs::Result::BAD_PROTOCOL:
+				ws->close(4001);
+				return;
+
+			case ConnectionArgs::Result::MALFORMED:
+				ws->close(4002);
+				return;
+
+			default:
+				break;
+		}
+
+		handleIncoming(ws, std::move(args), hd, ip);
 	});
 
 	h.onDisconnection([this] (uWS::WebSocket<uWS::SERVER> * ws, int c, const char * msg, sz_t len) {
 		Client * cl = static_cast<Client *>(ws->getUserData());
 		if (!cl) {
 			// still authenticating
-			auto ic = std::find_if(pending.begin(), pending.end(), [ws] (const IncomingConnection& ic) {
-				return ic.ws == ws;
-			});
-
-			if (ic != pending.end()) {
+			auto search = pendingSockets.find(ws);
+			if (search != pendingSockets.end()) {
+				IncomingConnection& ic = *search->second;
+				// the socket pointer could be reused by a new connection
+				// before the current async processor finishes
+				pendingSockets.erase(search);
 				// will get deleted once the current async processor finishes
-				ic->cancelled = true;
-				if (ic->onDisconnect) {
-					ic->onDisconnect();
+				ic.cancelled = true;
+				if (ic.onDisconnect) {
+					ic.onDisconnect();
 				}
 			}
 		} else {
@@ -112,6 +111,10 @@ void ConnectionManager::forEachClient(std::function<void(Client&)> f) {
 	});
 }
 
+sz_t ConnectionManager::pendingCount() const {
+	return pending.size();
+}
+
 void ConnectionManager::forEachProcessor(std::function<void(ConnectionProcessor&)> f) {
 	for (auto& p : processors) {
 		f(*p.get());
@@ -119,11 +122,12 @@ void ConnectionManager::forEachProcessor(std::function<void(ConnectionProcessor&
 }
 
 void ConnectionManager::handleIncoming(uWS::WebSocket<uWS::SERVER> * ws,
-		std::map<std::string, std::string> args, HttpData hd, Ip ip) {
+		ConnectionArgs args, HttpData hd, Ip ip) {
 	// can be optimized
 	pending.push_front({ConnectionInfo(), ws, std::move(args), processors.begin(), pending.end(), ip, nullptr, false});
 	auto ic = pending.begin();
 	ic->it = ic;
+	pendingSockets.emplace(ws, ic);
 
 	for (auto it = processors.begin(); it != processors.end(); ++it) {
 		if (!(*it)->preCheck(*ic, hd)) {
@@ -193,19 +197,28 @@ void ConnectionManager::handleEnd(IncomingConnection& ic) {
 	}
 
 	ic.ws->setUserData(cl);
-	pending.erase(ic.it);
+	erasePending(ic);
 
 	for (auto& p : processors) {
 		p->connected(*cl);
 	}
 }
 
+void ConnectionManager::erasePending(IncomingConnection& ic) {
+	auto search = pendingSockets.find(ic.ws);
+	if (search != pendingSockets.end() && search->second == ic.it) {
+		pendingSockets.erase(search);
+	}
+
+	pending.erase(ic.it);
+}
+
 void ConnectionManager::handleDisconnect(IncomingConnection& ic, bool all) {
 	// don't call disconnect on processors we didn't bother (on precheck)
 	const auto end = all ? processors.end() : ic.nextProcessor;
 
 	ClosedConnection cc(ic);
-	pending.erase(ic.it);
+	erasePending(ic);
 	for (auto it = processors.begin(); it != end; ++it) {
 		(*it)->disconnected(cc);
 	}
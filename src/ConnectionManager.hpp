@@ -5,6 +5,7 @@
 #include <map>
 #include <forward_list>
 #include <list>
+#include <unordered_map>
 #include <typeindex>
 #include <typeinfo>
 
@@ -12,6 +13,7 @@
 #include <shared_ptr_ll.hpp>
 #include <fwd_uWS.h>
 #include <Ip.hpp>
+#include <ConnectionArgs.hpp>
 
 class ConnectionProcessor;
 class IncomingConnection;
@@ -36,7 +38,7 @@ struct ConnectionInfo {
 struct IncomingConnection {
 	ConnectionInfo ci;
 	uWS::WebSocket<true> * ws;
-	std::map<std::string, std::string> args;
+	ConnectionArgs args;
 	std::forward_list<std::unique_ptr<ConnectionProcessor>>::iterator nextProcessor;
 	std::list<IncomingConnection>::iterator it; // own position in list
 	Ip ip;
@@ -50,6 +52,9 @@ class ConnectionManager {
 
 	std::forward_list<std::unique_ptr<ConnectionProcessor>> processors;
 	std::list<IncomingConnection> pending;
+	// to find the pending connection of a socket that closed. the socket's
+	// user data can't be used, anything non-null there is taken as a Client
+	std::unordered_map<uWS::WebSocket<true> *, std::list<IncomingConnection>::iterator> pendingSockets;
 	std::map<std::type_index, std::reference_wrapper<ConnectionProcessor>> processorTypeMap;
 	std::function<Client*(IncomingConnection&)> clientTransformer;
 
@@ -66,13 +71,15 @@ public:
 
 	void forEachProcessor(std::function<void(ConnectionProcessor&)>);
 	void forEachClient(std::function<void(Client&)>);
+	sz_t pendingCount() const;
 
 private:
-	void handleIncoming(uWS::WebSocket<true> *, std::map<std::string, std::string>, HttpData, Ip);
+	void handleIncoming(uWS::WebSocket<true> *, ConnectionArgs, HttpData, Ip);
 	void handleAsync(IncomingConnection&);
 	void handleFail(IncomingConnection&, const std::type_info&);
 	void handleEnd(IncomingConnection&);
 
+	void erasePending(IncomingConnection&);
 	void handleDisconnect(IncomingConnection&, bool);
 	void handleDisconnect(Client&);
 };
@@ -6,6 +6,7 @@
 
 bool ConnectionProcessor::isAsync(IncomingConnection&) { return false; }
 
+bool ConnectionProcessor::admit(const Ip&) { return true; }
 bool ConnectionProcessor::preCheck(IncomingConnection&, HttpData) { return true; }
 void ConnectionProcessor::asyncCheck(IncomingConnection&, std::function<void(bool)>) { }
 bool ConnectionProcessor::endCheck(IncomingConnection&) { return true; }
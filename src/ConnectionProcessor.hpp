@@ -8,6 +8,7 @@ struct IncomingConnection;
 struct ClosedConnection;
 class Client;
 class HttpData;
+class Ip;
 
 class ConnectionProcessor {
 public:
@@ -15,6 +16,8 @@ public:
 
 	virtual bool isAsync(IncomingConnection&);
 
+	// runs first, before anything is parsed or allocated for the socket
+	virtual bool admit(const Ip&);
 	virtual bool preCheck(IncomingConnection&, HttpData);
 	virtual void asyncCheck(IncomingConnection&, std::function<void(bool)> cb);
 	virtual bool endCheck(IncomingConnection&);
@@ -0,0 +1,205 @@
+#include "MemoryMonitor.hpp"
+
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <algorithm>
+
+#include <unistd.h>
+
+#include <nlohmann/json.hpp>
+
+#include <config.hpp>
+
+// checks between raising the budgets, and max checks between lowering them
+static constexpr u32 growWait = 10;
+static constexpr u32 maxBackoff = 64;
+
+// returns 0 if the file is missing or has no limit set
+static u64 readCgroupValue(const char * path) {
+	std::ifstream file(path);
+	std::string s;
+	if (!(file >> s) || s == "max") {
+		return 0;
+	}
+
+	try {
+		u64 v = std::stoull(s);
+		// v1 uses a huge number for no limit
+		return v >= (u64(1) << 62) ? 0 : v;
+	} catch (const std::exception&) {
+		return 0;
+	}
+}
+
+MemoryMonitor::MemoryMonitor()
+: limit(readLimit()),
+  rss(0),
+  usage{0, 0, 0, 0},
+  pressure(Pressure::NONE),
+  chunkPercent(100),
+  pngPercent(100),
+  wait(0),
+  backoff(1),
+  softSheds(0),
+  hardSheds(0),
+  freedBytes(0) {
+	if (limit) {
+		std::cout << "Memory limit: " << limit / 1024 / 1024 << " MiB" << std::endl;
+	} else {
+		std::cerr << "Couldn't find the memory limit, memory pressure won't be checked" << std::endl;
+	}
+}
+
+void MemoryMonitor::setUsage(Usage u) {
+	usage = u;
+}
+
+MemoryMonitor::Pressure MemoryMonitor::poll() {
+	rss = readResidentBytes();
+	if (limit == 0 || rss == 0) {
+		pressure = Pressure::NONE;
+	} else if (rss > limit / 100 * SERVER_MEMORY_HARD_PERCENT) {
+		pressure = Pressure::HARD;
+	} else if (rss > limit / 100 * SERVER_MEMORY_SOFT_PERCENT) {
+		pressure = Pressure::SOFT;
+	} else {
+		pressure = Pressure::NONE;
+	}
+
+	return pressure;
+}
+
+// the pngs go first, they're faster to encode again than chunks to load.
+// if the usage doesn't go down, like when the freed memory is fragmented,
+// the steps get further apart instead of emptying the caches every check
+bool MemoryMonitor::adjustBudgets() {
+	const u8 min = SERVER_MEMORY_MIN_BUDGET_PERCENT;
+	if (pressure == Pressure::NONE) {
+		if (rss > limit / 100 * SERVER_MEMORY_RECOVER_PERCENT) {
+			// between the recover and soft limits, keep everything as is
+			wait = wait > 0 ? wait - 1 : 0;
+			return false;
+		}
+
+		backoff = 1;
+		if ((wait > 0 && --wait > 0) || (chunkPercent == 100 && pngPercent == 100)) {
+			return false;
+		}
+
+		if (chunkPercent < 100) {
+			chunkPercent = std::min(100, chunkPercent + 10);
+		} else {
+			pngPercent = std::min(100, pngPercent + 10);
+		}
+
+		wait = growWait;
+		std::cout << "Memory usage is low again, cache budgets raised to "
+			<< +chunkPercent << "% (chunks), " << +pngPercent << "% (pngs)" << std::endl;
+		return true;
+	}
+
+	if (chunkPercent == min && pngPercent == min) {
+		return false;
+	}
+
+	if (pressure == Pressure::HARD) {
+		chunkPercent = std::max<u8>(min, chunkPercent / 2);
+		pngPercent = std::max<u8>(min, pngPercent / 2);
+	} else if (wait > 0 && --wait > 0) {
+		return false;
+	} else if (pngPercent > min) {
+		pngPercent = std::max<u8>(min, pngPercent / 2);
+	} else {
+		chunkPercent = std::max<u8>(min, chunkPercent / 4 * 3);
+	}
+
+	wait = backoff;
+	backoff = std::min(backoff * 2, maxBackoff);
+	return true;
+}
+
+void MemoryMonitor::shed(Pressure p, u64 freed) {
+	if (p == Pressure::HARD) {
+		++hardSheds;
+	} else {
+		++softSheds;
+	}
+
+	freedBytes += freed;
+	std::cerr << (p == Pressure::HARD ? "High" : "Rising") << " memory usage ("
+		<< rss / 1024 / 1024 << "/" << limit / 1024 / 1024 << " MiB), cache budgets lowered to "
+		<< +chunkPercent << "% (chunks), " << +pngPercent << "% (pngs), freed "
+		<< freed / 1024 << " KiB" << std::endl;
+}
+
+u64 MemoryMonitor::getLimit()         const { return limit; }
+u64 MemoryMonitor::getResidentBytes() const { return rss; }
+const MemoryMonitor::Usage& MemoryMonitor::getUsage() const { return usage; }
+MemoryMonitor::Pressure MemoryMonitor::getPressure() const { return pressure; }
+u8 MemoryMonitor::getChunkBudgetPercent() const { return chunkPercent; }
+u8 MemoryMonitor::getPngBudgetPercent()   const { return pngPercent; }
+u64 MemoryMonitor::getSoftSheds()     const { return softSheds; }
+u64 MemoryMonitor::getHardSheds()     const { return hardSheds; }
+u64 MemoryMonitor::getFreedBytes()    const { return freedBytes; }
+
+u64 MemoryMonitor::readLimit() {
+	u64 limit = 0;
+	long pages = sysconf(_SC_PHYS_PAGES);
+	long pageSize = sysconf(_SC_PAGESIZE);
+	if (pages > 0 && pageSize > 0) {
+		limit = u64(pages) * pageSize;
+	}
+
+	// cgroup v2, then v1
+	u64 cg = readCgroupValue("/sys/fs/cgroup/memory.max");
+	if (!cg) {
+		cg = readCgroupValue("/sys/fs/cgroup/memory/memory.limit_in_bytes");
+	}
+
+	if (cg && (!limit || cg < limit)) {
+		limit = cg;
+	}
+
+	return limit;
+}
+
+u64 MemoryMonitor::readResidentBytes() {
+	// size resident ...
+	std::ifstream statm("/proc/self/statm");
+	u64 size = 0;
+	u64 resident = 0;
+	if (!(statm >> size >> resident)) {
+		return 0;
+	}
+
+	return resident * sysconf(_SC_PAGESIZE);
+}
+
+static const char * toString(MemoryMonitor::Pressure p) {
+	switch (p) {
+		case MemoryMonitor::Pressure::SOFT: return "soft";
+		case MemoryMonitor::Pressure::HARD: return "hard";
+		default: return "none";
+	}
+}
+
+void to_json(nlohmann::json& j, const MemoryMonitor& m) {
+	const auto& u = m.getUsage();
+	j = {
+		{ "limit", m.getLimit() },
+		{ "resident", m.getResidentBytes() },
+		{ "pressure", toString(m.getPressure()) },
+		{ "chunkBudgetPercent", m.getChunkBudgetPercent() },
+		{ "pngBudgetPercent", m.getPngBudgetPercent() },
+		{ "usage", {
+			{ "chunks", u.chunks },
+			{ "pngCaches", u.pngCaches },
+			{ "pendingConnections", u.pendingConnections },
+			{ "sessions", u.sessions }
+		}},
+		{ "softSheds", m.getSoftSheds() },
+		{ "hardSheds", m.getHardSheds() },
+		{ "freedBytes", m.getFreedBytes() }
+	};
+}
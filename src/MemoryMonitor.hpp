@@ -0,0 +1,64 @@
+#pragma once
+
+#include <explints.hpp>
+
+#include <nlohmann/json_fwd.hpp>
+
+// Polls the resident memory of the process against the memory limit, the
+// smallest of the cgroup limit and the physical memory. Under pressure it
+// lowers the chunk cache budgets step by step, pngs first, and raises them
+// back once the usage is low again, see Server::checkMemory
+class MemoryMonitor {
+public:
+	enum class Pressure : u8 {
+		NONE,
+		SOFT, // lower the budgets, one step at a time
+		HARD  // halve the budgets on every check
+	};
+
+	// estimated bytes held by each part of the server, set before polling
+	struct Usage {
+		u64 chunks;
+		u64 pngCaches;
+		u64 pendingConnections;
+		u64 sessions;
+	};
+
+private:
+	u64 limit; // 0 if unknown
+	u64 rss;
+	Usage usage;
+	Pressure pressure;
+	u8 chunkPercent; // of the configured budgets
+	u8 pngPercent;
+	u32 wait; // checks left until the budgets can change again
+	u32 backoff; // wait after the next step down
+	u64 softSheds;
+	u64 hardSheds;
+	u64 freedBytes; // by the sheds
+
+public:
+	MemoryMonitor();
+
+	void setUsage(Usage);
+	Pressure poll();
+	// returns true if the budgets changed, call after poll()
+	bool adjustBudgets();
+	void shed(Pressure, u64 freed);
+
+	u64 getLimit() const;
+	u64 getResidentBytes() const;
+	const Usage& getUsage() const;
+	Pressure getPressure() const;
+	u8 getChunkBudgetPercent() const;
+	u8 getPngBudgetPercent() const;
+	u64 getSoftSheds() const;
+	u64 getHardSheds() const;
+	u64 getFreedBytes() const;
+
+private:
+	static u64 readLimit();
+	static u64 readResidentBytes();
+};
+
+void to_json(nlohmann::json&, const MemoryMonitor&);
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <functional>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include <explints.hpp>
+
+// hashes std::string and std::string_view the same, for lookups without copies
+struct TransparentStringHash {
+	sz_t operator()(std::string_view s) const {
+		return std::hash<std::string_view>()(s);
+	}
+};
+
+// Hash map with linear probing, and backward shift deletion so there are no
+// tombstones. Lookups accept any type that Hash and Eq accept, like a
+// string_view for string keys. Pointers to entries are invalidated by any
+// insertion or erase.
+template<typename K, typename V, typename Hash = std::hash<K>, typename Eq = std::equal_to<>>
+class OpenHashMap {
+public:
+	using value_type = std::pair<K, V>;
+
+private:
+	std::vector<std::optional<value_type>> slots;
+	sz_t count;
+	sz_t sweepPos; // next slot to check in sweep()
+	u32 shift; // 64 - log2(slots.size())
+
+public:
+	OpenHashMap();
+
+	template<typename Q>
+	value_type * find(const Q& key);
+	template<typename Q>
+	const value_type * find(const Q& key) const;
+
+	template<typename... Args>
+	std::pair<value_type *, bool> try_emplace(K key, Args&&... args);
+	value_type * insert_or_assign(K key, V value);
+
+	template<typename Q>
+	bool erase(const Q& key);
+
+	// checks up to maxSlots entries, continuing from the last call, and
+	// erases those where remove(entry) is true. returns the amount erased
+	template<typename Fn>
+	sz_t sweep(sz_t maxSlots, Fn remove);
+
+	template<typename Fn>
+	void forEach(Fn f);
+	template<typename Fn>
+	void forEach(Fn f) const;
+
+	sz_t size() const;
+	sz_t capacity() const;
+
+private:
+	sz_t indexFor(sz_t hash) const;
+	template<typename Q>
+	sz_t findIndex(const Q& key) const; // returns slots.size() if missing
+	void eraseAt(sz_t i);
+	void grow();
+};
+
+#include "OpenHashMap.tpp"
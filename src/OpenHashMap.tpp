@@ -0,0 +1,175 @@
+#include <algorithm>
+
+template<typename K, typename V, typename Hash, typename Eq>
+OpenHashMap<K, V, Hash, Eq>::OpenHashMap()
+: slots(16),
+  count(0),
+  sweepPos(0),
+  shift(64 - 4) { }
+
+template<typename K, typename V, typename Hash, typename Eq>
+template<typename Q>
+typename OpenHashMap<K, V, Hash, Eq>::value_type * OpenHashMap<K, V, Hash, Eq>::find(const Q& key) {
+	sz_t i = findIndex(key);
+	return i != slots.size() ? &*slots[i] : nullptr;
+}
+
+template<typename K, typename V, typename Hash, typename Eq>
+template<typename Q>
+const typename OpenHashMap<K, V, Hash, Eq>::value_type * OpenHashMap<K, V, Hash, Eq>::find(const Q& key) const {
+	sz_t i = findIndex(key);
+	return i != slots.size() ? &*slots[i] : nullptr;
+}
+
+template<typename K, typename V, typename Hash, typename Eq>
+template<typename... Args>
+std::pair<typename OpenHashMap<K, V, Hash, Eq>::value_type *, bool> OpenHashMap<K, V, Hash, Eq>::try_emplace(K key, Args&&... args) {
+	if (value_type * e = find(key)) {
+		return {e, false};
+	}
+
+	// max load factor of 3/4
+	if ((count + 1) * 4 > slots.size() * 3) {
+		grow();
+	}
+
+	const sz_t mask = slots.size() - 1;
+	sz_t i = indexFor(Hash()(key));
+	while (slots[i]) {
+		i = (i + 1) & mask;
+	}
+
+	slots[i].emplace(std::piecewise_construct, std::forward_as_tuple(std::move(key)),
+		std::forward_as_tuple(std::forward<Args>(args)...));
+	++count;
+	return {&*slots[i], true};
+}
+
+template<typename K, typename V, typename Hash, typename Eq>
+typename OpenHashMap<K, V, Hash, Eq>::value_type * OpenHashMap<K, V, Hash, Eq>::insert_or_assign(K key, V value) {
+	auto res = try_emplace(std::move(key), std::move(value));
+	if (!res.second) {
+		res.first->second = std::move(value);
+	}
+
+	return res.first;
+}
+
+template<typename K, typename V, typename Hash, typename Eq>
+template<typename Q>
+bool OpenHashMap<K, V, Hash, Eq>::erase(const Q& key) {
+	sz_t i = findIndex(key);
+	if (i == slots.size()) {
+		return false;
+	}
+
+	eraseAt(i);
+	return true;
+}
+
+template<typename K, typename V, typename Hash, typename Eq>
+template<typename Fn>
+sz_t OpenHashMap<K, V, Hash, Eq>::sweep(sz_t maxSlots, Fn remove) {
+	sz_t erased = 0;
+	maxSlots = std::min(maxSlots, slots.size());
+	for (sz_t n = 0; n < maxSlots; n++) {
+		sweepPos &= slots.size() - 1;
+		auto& s = slots[sweepPos];
+		if (s && remove(*s)) {
+			// another entry may have been shifted here, check it next time
+			eraseAt(sweepPos);
+			++erased;
+		} else {
+			++sweepPos;
+		}
+	}
+
+	return erased;
+}
+
+template<typename K, typename V, typename Hash, typename Eq>
+template<typename Fn>
+void OpenHashMap<K, V, Hash, Eq>::forEach(Fn f) {
+	for (auto& s : slots) {
+		if (s) {
+			f(*s);
+		}
+	}
+}
+
+template<typename K, typename V, typename Hash, typename Eq>
+template<typename Fn>
+void OpenHashMap<K, V, Hash, Eq>::forEach(Fn f) const {
+	for (const auto& s : slots) {
+		if (s) {
+			f(*s);
+		}
+	}
+}
+
+template<typename K, typename V, typename Hash, typename Eq>
+sz_t OpenHashMap<K, V, Hash, Eq>::size() const {
+	return count;
+}
+
+template<typename K, typename V, typename Hash, typename Eq>
+sz_t OpenHashMap<K, V, Hash, Eq>::capacity() const {
+	return slots.size();
+}
+
+// fibonacci hashing, spreads sequential keys like user ids
+template<typename K, typename V, typename Hash, typename Eq>
+sz_t OpenHashMap<K, V, Hash, Eq>::indexFor(sz_t hash) const {
+	return (u64(hash) * 0x9E3779B97F4A7C15ull) >> shift;
+}
+
+template<typename K, typename V, typename Hash, typename Eq>
+template<typename Q>
+sz_t OpenHashMap<K, V, Hash, Eq>::findIndex(const Q& key) const {
+	const sz_t mask = slots.size() - 1;
+	for (sz_t i = indexFor(Hash()(key)); slots[i]; i = (i + 1) & mask) {
+		if (Eq()(slots[i]->first, key)) {
+			return i;
+		}
+	}
+
+	return slots.size();
+}
+
+// moves back the entries after i that would be unreachable with i empty
+template<typename K, typename V, typename Hash, typename Eq>
+void OpenHashMap<K, V, Hash, Eq>::eraseAt(sz_t i) {
+	const sz_t mask = slots.size() - 1;
+	sz_t hole = i;
+	for (sz_t j = (i + 1) & mask; slots[j]; j = (j + 1) & mask) {
+		sz_t home = indexFor(Hash()(slots[j]->first));
+		// distance from home to j is greater or equal than from home to hole
+		if (((j - home) & mask) >= ((j - hole) & mask)) {
+			slots[hole] = std::move(slots[j]);
+			hole = j;
+		}
+	}
+
+	slots[hole].reset();
+	--count;
+}
+
+template<typename K, typename V, typename Hash, typename Eq>
+void OpenHashMap<K, V, Hash, Eq>::grow() {
+	std::vector<std::optional<value_type>> old(slots.size() * 2);
+	old.swap(slots);
+	--shift;
+	sweepPos = 0;
+
+	const sz_t mask = slots.size() - 1;
+	for (auto& s : old) {
+		if (s) {
+			sz_t i = indexFor(Hash()(s->first));
+			while (slots[i]) {
+				i = (i + 1) & mask;
+			}
+
+			slots[i] = std::move(s);
+		}
+	}
+}
@@ -33,7 +33,7 @@ enum tc : u8 {
 };
 
 using Cursor = std::tuple<Player::Id, World::Pos, World::Pos, Player::Step, Player::Tid>;
-using Pixel  = std::tuple<World::Pos, World::Pos, u8, u8, u8>;
+using Pixel  = std::tuple<Player::Id, World::Pos, World::Pos, u8, u8, u8>; // pixupd_t
 using Bucket = std::tuple<Bucket::Rate, Bucket::Per, Bucket::Allowance>;
 
 } // namespace net
@@ -52,7 +52,8 @@ using PlayersHide = Packet<net::tc::HIDE_PLAYERS, std::vector<Player::Id>>;
 
 // world name, motd, bg color, drawing restricted, owner
 using WorldData        = Packet<net::tc::WORLD_DATA,     std::string, std::string, u32, bool, std::optional<User::Id>>;
-using WorldUpdate      = Packet<net::tc::WORLD_UPDATE,   std::vector<net::Cursor>, std::vector<net::Pixel>>;
+// players left, cursors, pixels. Built by World::sendUpdates, with u8, u8 and u16 counts
+using WorldUpdate      = Packet<net::tc::WORLD_UPDATE,   std::vector<Player::Id>, std::vector<net::Cursor>, std::vector<net::Pixel>>;
 #pragma message("Change Player class to Cursor")
 //using ToolState        = Packet<net::tc::TOOL_STATE,     Player::Id, >
 using ChatMessage      = Packet<net::tc::CHAT_MESSAGE,   User::Id, std::string>;
@@ -0,0 +1,351 @@
+#include "PixelLog.hpp"
+
+#include <iostream>
+#include <fstream>
+#include <chrono>
+#include <thread>
+#include <deque>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <limits>
+#include <algorithm>
+#include <cerrno>
+#include <glob.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <config.hpp>
+
+// One thread writes and syncs the logs of every world. It sleeps until a
+// log has something to do, then waits the commit interval, so everything
+// appended meanwhile is synced at once. Runs while any log exists
+class PixelLog::Writer {
+	std::mutex startStop; // attach and detach, held while joining
+	std::mutex lock;
+	std::condition_variable cv;
+	std::deque<PixelLog *> queued;
+	PixelLog * busy = nullptr; // being committed, unlocked
+	std::thread thread;
+	u32 users = 0;
+	bool stopping = false;
+
+public:
+	static Writer& get() {
+		static Writer w;
+		return w;
+	}
+
+	~Writer() {
+		stop();
+	}
+
+	void attach() {
+		std::lock_guard<std::mutex> s(startStop);
+		std::lock_guard<std::mutex> _(lock);
+		if (users++ == 0) {
+			stopping = false;
+			thread = std::thread([this] {
+				run();
+			});
+		}
+	}
+
+	// the writer won't touch the log after this
+	void detach(PixelLog& l) {
+		std::lock_guard<std::mutex> s(startStop);
+		{
+			std::unique_lock<std::mutex> lk(lock);
+			queued.erase(std::remove(queued.begin(), queued.end(), &l), queued.end());
+			cv.wait(lk, [this, &l] {
+				return busy != &l;
+			});
+
+			if (--users != 0) {
+				return;
+			}
+		}
+
+		stop();
+	}
+
+	void queue(PixelLog& l) {
+		{
+			std::lock_guard<std::mutex> _(lock);
+			queued.push_back(&l);
+		}
+
+		cv.notify_all();
+	}
+
+private:
+	void stop() {
+		{
+			std::lock_guard<std::mutex> _(lock);
+			stopping = true;
+		}
+
+		cv.notify_all();
+		if (thread.joinable()) {
+			thread.join();
+		}
+	}
+
+	void run() {
+		std::unique_lock<std::mutex> lk(lock);
+		while (true) {
+			cv.wait(lk, [this] {
+				return stopping || !queued.empty();
+			});
+
+			if (stopping) {
+				break;
+			}
+
+			// group commit
+			cv.wait_for(lk, std::chrono::milliseconds(WORLD_PIXEL_LOG_COMMIT_MSEC), [this] {
+				return stopping;
+			});
+
+			while (!queued.empty()) {
+				PixelLog * l = queued.front();
+				queued.pop_front();
+				busy = l;
+				lk.unlock();
+				l->commit(true);
+				lk.lock();
+				busy = nullptr;
+				cv.notify_all();
+			}
+		}
+	}
+};
+
+PixelLog::PixelLog(std::string worldDir)
+: dir(std::move(worldDir)),
+  firstSegment(std::numeric_limits<u32>::max()),
+  segment(0),
+  keepAll(false),
+  queued(false),
+  failing(false),
+  fd(-1),
+  fdSegment(0),
+  unsynced(false),
+  errors(false) {
+	glob_t result; // XXX: careful with exceptions here
+	std::string pattern(dir + "/pixels.*.log");
+	if (int err = glob(pattern.c_str(), GLOB_NOSORT, nullptr, &result)) {
+		if (err != GLOB_NOMATCH) {
+			std::cerr << "glob() error: " << err << std::endl;
+		}
+	} else {
+		for (sz_t i = 0; i < result.gl_pathc; i++) {
+			u32 s = std::strtoul(result.gl_pathv[i] + dir.size() + 8, nullptr, 10);
+			firstSegment = std::min(firstSegment, s);
+			segment = std::max(segment, s + 1);
+		}
+
+		globfree(&result);
+	}
+
+	if (firstSegment > segment) {
+		firstSegment = segment;
+	}
+
+	discardUpTo = firstSegment;
+	discarded = firstSegment;
+	Writer::get().attach();
+}
+
+// writes the pending records, and deletes the discarded segments
+PixelLog::~PixelLog() {
+	Writer::get().detach(*this);
+	commit(false);
+	if (fd >= 0) {
+		::close(fd);
+	}
+}
+
+void PixelLog::append(const pixupd_t& p) {
+	{
+		std::lock_guard<std::mutex> _(lock);
+		if (pending.empty() || pending.back().segment != segment) {
+			pending.push_back({segment, {}});
+		}
+
+		pending.back().records.push_back(p);
+		if (queued) {
+			return;
+		}
+
+		queued = true;
+	}
+
+	Writer::get().queue(*this);
+}
+
+u32 PixelLog::rotate() {
+	std::lock_guard<std::mutex> _(lock);
+	return ++segment;
+}
+
+void PixelLog::discardBefore(u32 s) {
+	{
+		std::lock_guard<std::mutex> _(lock);
+		if (keepAll || s <= discardUpTo) {
+			return;
+		}
+
+		discardUpTo = s;
+		if (queued) {
+			return;
+		}
+
+		queued = true;
+	}
+
+	Writer::get().queue(*this);
+}
+
+void PixelLog::chunkSaveFailed() {
+	std::lock_guard<std::mutex> _(lock);
+	keepAll = true;
+}
+
+void PixelLog::chunksSaved() {
+	std::lock_guard<std::mutex> _(lock);
+	keepAll = false;
+}
+
+bool PixelLog::isFailing() const {
+	return failing.load(std::memory_order_relaxed);
+}
+
+void PixelLog::forEachRecord(std::function<void(const pixupd_t&)> f) {
+	for (u32 s = firstSegment; s < segment; s++) {
+		std::ifstream file(getPath(s), std::ios::binary);
+		pixupd_t p;
+		// a record cut by a crash is ignored
+		while (file.read(reinterpret_cast<char *>(&p), sizeof(p))) {
+			f(p);
+		}
+	}
+}
+
+std::string PixelLog::getPath(u32 s) const {
+	return dir + "/pixels." + std::to_string(s) + ".log";
+}
+
+// runs in the writer thread, or in the destructor once detached. batches that
+// couldn't be written are tried again on the next commit, if retry is set
+void PixelLog::commit(bool retry) {
+	std::vector<Batch> batches;
+	u32 discard;
+	{
+		std::lock_guard<std::mutex> _(lock);
+		batches.swap(pending);
+		discard = discardUpTo;
+		queued = false;
+	}
+
+	errors = false;
+	auto failed = batches.end();
+	for (auto it = batches.begin(); it != batches.end(); ++it) {
+		if (!write(*it)) {
+			failed = it;
+			break;
+		}
+	}
+
+	sync();
+	bool ok = !errors;
+	if (ok != !failing.load(std::memory_order_relaxed)) {
+		failing.store(!ok, std::memory_order_relaxed);
+		std::cerr << "Pixel log of " << dir << (ok ? " is being written again" : " failed, painted pixels may be lost on a crash") << std::endl;
+	}
+
+	if (retry && failed != batches.end()) {
+		bool wasQueued;
+		{
+			std::lock_guard<std::mutex> _(lock);
+			pending.insert(pending.begin(), std::make_move_iterator(failed), std::make_move_iterator(batches.end()));
+			wasQueued = queued;
+			queued = true;
+		}
+
+		if (!wasQueued) {
+			Writer::get().queue(*this);
+		}
+	}
+
+	for (; discarded < discard; discarded++) {
+		if (fd >= 0 && fdSegment == discarded) {
+			::close(fd);
+			fd = -1;
+		}
+
+		std::remove(getPath(discarded).c_str());
+	}
+}
+
+// on errors the file is cut back to where it was, so records stay aligned
+bool PixelLog::write(const Batch& b) {
+	if (fd < 0 || fdSegment != b.segment) {
+		sync();
+		if (fd >= 0) {
+			::close(fd);
+		}
+
+		fdSegment = b.segment;
+		fd = ::open(getPath(b.segment).c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+		if (fd < 0) {
+			logError("Couldn't open pixel log (" + getPath(b.segment) + ")");
+			return false;
+		}
+	}
+
+	off_t start = ::lseek(fd, 0, SEEK_END);
+	const char * buf = reinterpret_cast<const char *>(b.records.data());
+	sz_t size = b.records.size() * sizeof(pixupd_t);
+	while (size > 0) {
+		ssize_t w = ::write(fd, buf, size);
+		if (w < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+
+			logError("Couldn't write pixel log (" + getPath(b.segment) + ")");
+			if (start >= 0 && ::ftruncate(fd, start) != 0) {
+				logError("Couldn't truncate pixel log (" + getPath(b.segment) + ")");
+			}
+
+			return false;
+		}
+
+		buf += w;
+		size -= w;
+	}
+
+	unsynced = true;
+	return true;
+}
+
+void PixelLog::sync() {
+	if (fd < 0 || !unsynced) {
+		return;
+	}
+
+	unsynced = false;
+	if (::fdatasync(fd) != 0) {
+		logError("Couldn't sync pixel log (" + getPath(fdSegment) + ")");
+	}
+}
+
+// errors are printed until the log is failing, then once it works again
+void PixelLog::logError(const std::string& msg) {
+	errors = true;
+	if (!failing.load(std::memory_order_relaxed)) {
+		std::perror(msg.c_str());
+	}
+}
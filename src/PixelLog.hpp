@@ -0,0 +1,71 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include <functional>
+
+#include <types.hpp>
+#include <explints.hpp>
+
+// Append only log of the painted pixels, so a crash doesn't lose the
+// changes made since the last save. Records are written and synced in
+// batches by a thread shared by every log. A new segment is started on
+// every world save, and the older ones are deleted once that save is on disk.
+class PixelLog {
+	class Writer;
+
+	struct Batch {
+		u32 segment;
+		std::vector<pixupd_t> records;
+	};
+
+	const std::string dir;
+
+	std::mutex lock;
+	std::vector<Batch> pending; // written on the next commit
+	u32 firstSegment; // oldest segment on disk
+	u32 segment; // where new records go
+	u32 discardUpTo; // segments below this can be deleted
+	bool keepAll; // some logged pixels aren't in any chunk on disk, see chunkSaveFailed
+	bool queued; // waiting for the writer thread
+	std::atomic<bool> failing; // the last commit had errors
+
+	// only used by the writer thread, and the destructor
+	int fd;
+	u32 fdSegment;
+	u32 discarded;
+	bool unsynced;
+	bool errors; // in the current commit
+
+public:
+	PixelLog(std::string worldDir);
+	~PixelLog();
+
+	PixelLog(const PixelLog&) = delete;
+
+	void append(const pixupd_t&);
+
+	// returns the segment that new records go to, the previous ones
+	// can be discarded once every chunk is saved
+	u32 rotate();
+	void discardBefore(u32 segment);
+	// a chunk was unloaded or replayed without being saved, its pixels are
+	// only here now. nothing is discarded until they're saved, and
+	// chunksSaved is called, or until the world is loaded again
+	void chunkSaveFailed();
+	void chunksSaved();
+	// records couldn't be written or synced, they'd be lost on a crash
+	bool isFailing() const;
+
+	// reads the segments left from the last run, before any appends
+	void forEachRecord(std::function<void(const pixupd_t&)>);
+
+private:
+	std::string getPath(u32 segment) const;
+	void commit(bool retry);
+	bool write(const Batch&);
+	void sync();
+	void logError(const std::string&);
+};
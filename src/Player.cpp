@@ -24,7 +24,8 @@ Player::Player(Client& c, World& w, u32 pid, World::Pos startX, World::Pos start
   cmdsAllowed(cmds),
   modifyWorldAllowed(mod),
   toolId(0),
-  pixelStep(0) {
+  pixelStep(0),
+  updateQueued(false) {
 	PlayerData::one(cl.getWs(),
 			std::make_tuple(playerId, x, y, pixelStep, toolId),
 			std::make_tuple(paintLimiter.getRate(), paintLimiter.getPer(), paintLimiter.getAllowance()),
@@ -56,6 +57,15 @@ bool Player::canModifyWorld() const {
 	return modifyWorldAllowed;
 }
 
+void Player::setPaintRate(u16 rate, u16 per) {
+	paintLimiter = Bucket(rate, per);
+	PlayerData::one(cl.getWs(),
+			std::make_tuple(playerId, x, y, pixelStep, toolId),
+			std::make_tuple(paintLimiter.getRate(), paintLimiter.getPer(), paintLimiter.getAllowance()),
+			std::make_tuple(chatLimiter.getRate(), chatLimiter.getPer(), chatLimiter.getAllowance()),
+			chatAllowed, modifyWorldAllowed);
+}
+
 Client& Player::getClient() const {
 	return cl;
 }
@@ -84,10 +94,22 @@ Player::Step Player::getStep() const {
 	return pixelStep;
 }
 
+Player::Tid Player::getToolId() const {
+	return toolId;
+}
+
 Player::Id Player::getPid() const {
 	return playerId;
 }
 
+bool Player::isUpdateQueued() const {
+	return updateQueued;
+}
+
+void Player::setUpdateQueued(bool state) {
+	updateQueued = state;
+}
+
 void Player::teleportTo(World::Pos newX, World::Pos newY) {
 	x = newX;
 	y = newY;
@@ -33,6 +33,7 @@ private: // 65 b?
 	bool modifyWorldAllowed;
 	Tid toolId;
 	Step pixelStep;
+	bool updateQueued; // in the world's cursor update queue
 
 public:
 	Player(const Player&) = delete;
@@ -56,8 +57,12 @@ public:
 	WorldPos getX() const;
 	WorldPos getY() const;
 	Step getStep() const;
+	Tid getToolId() const;
 	Id getPid() const;
 
+	bool isUpdateQueued() const;
+	void setUpdateQueued(bool);
+
 	void teleportTo(WorldPos x, WorldPos y);
 	void tell(const std::string&);
 
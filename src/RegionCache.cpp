@@ -0,0 +1,130 @@
+#include "RegionCache.hpp"
+
+#include <algorithm>
+#include <cstdio>
+
+#include <utils.hpp>
+
+static u64 regionKey(i32 chunkX, i32 chunkY) {
+	u32 rx = chunkX >> RegionFile::regionShift;
+	u32 ry = chunkY >> RegionFile::regionShift;
+	return u64(ry) << 32 | rx;
+}
+
+RegionCache::RegionCache(std::string worldDir, sz_t maxHandles)
+: dir(std::move(worldDir)),
+  maxHandles(maxHandles == 0 ? 1 : maxHandles) { }
+
+bool RegionCache::has(i32 chunkX, i32 chunkY) {
+	auto r(get(chunkX, chunkY, false));
+	return r && r->has(RegionFile::indexOf(chunkX, chunkY));
+}
+
+std::vector<u8> RegionCache::read(i32 chunkX, i32 chunkY) {
+	auto r(get(chunkX, chunkY, false));
+	return r ? r->read(RegionFile::indexOf(chunkX, chunkY)) : std::vector<u8>();
+}
+
+void RegionCache::write(i32 chunkX, i32 chunkY, const std::vector<u8>& data) {
+	// the file could be removed by an erase before it's locked, then a new one is made
+	while (!get(chunkX, chunkY, true)->write(RegionFile::indexOf(chunkX, chunkY), data.data(), data.size()));
+}
+
+void RegionCache::erase(i32 chunkX, i32 chunkY) {
+	auto r(get(chunkX, chunkY, false));
+	if (r && r->erase(RegionFile::indexOf(chunkX, chunkY))) {
+		removed(regionKey(chunkX, chunkY), *r);
+	}
+}
+
+// calls f with the position of every chunk stored in this region
+void RegionCache::forEachChunkIn(i32 regionX, i32 regionY, std::function<void(i32, i32)> f) {
+	i32 baseX = regionX * RegionFile::regionSize;
+	i32 baseY = regionY * RegionFile::regionSize;
+	auto r(get(baseX, baseY, false));
+	if (!r) {
+		return;
+	}
+
+	for (u32 i = 0; i < RegionFile::chunksPerRegion; i++) {
+		if (r->has(i)) {
+			f(baseX + (i & (RegionFile::regionSize - 1)), baseY + (i >> RegionFile::regionShift));
+		}
+	}
+}
+
+// closed files are synced too, the list is copied so syncs don't block the others
+void RegionCache::syncAll() {
+	std::vector<std::shared_ptr<RegionFile>> files;
+	{
+		std::lock_guard<std::mutex> _(lock);
+		for (auto& r : regions) {
+			files.emplace_back(r.second);
+		}
+	}
+
+	for (auto& r : files) {
+		r->sync();
+	}
+}
+
+void RegionCache::closeAll() {
+	syncAll();
+
+	std::lock_guard<std::mutex> _(lock);
+	for (auto& r : regions) {
+		r.second->close();
+	}
+
+	openRegions.clear();
+}
+
+std::string RegionCache::getPath(i32 regionX, i32 regionY) const {
+	return dir + "/region." + std::to_string(regionX) + "." + std::to_string(regionY) + ".bin";
+}
+
+std::shared_ptr<RegionFile> RegionCache::get(i32 chunkX, i32 chunkY, bool create) {
+	std::lock_guard<std::mutex> _(lock);
+	u64 k = regionKey(chunkX, chunkY);
+	auto search = regions.find(k);
+	if (search == regions.end() || search->second->isRemoved()) {
+		std::string path(getPath(chunkX >> RegionFile::regionShift, chunkY >> RegionFile::regionShift));
+		if (!create && !fileExists(path)) {
+			return nullptr;
+		}
+
+		// the file is opened to read the offset table
+		auto r(std::make_shared<RegionFile>(std::move(path)));
+		search = regions.insert_or_assign(k, std::move(r)).first;
+	}
+
+	used(k);
+	return search->second;
+}
+
+// marks the region file as recently used, closes the oldest one if needed
+void RegionCache::used(u64 k) {
+	auto it = std::find(openRegions.begin(), openRegions.end(), k);
+	if (it != openRegions.end()) {
+		openRegions.erase(it);
+	} else if (openRegions.size() >= maxHandles) {
+		regions.at(openRegions.front())->close();
+		openRegions.erase(openRegions.begin());
+	}
+
+	openRegions.push_back(k);
+}
+
+void RegionCache::removed(u64 k, const RegionFile& r) {
+	std::lock_guard<std::mutex> _(lock);
+	auto search = regions.find(k);
+	if (search == regions.end() || search->second.get() != &r) {
+		return;
+	}
+
+	regions.erase(search);
+	auto it = std::find(openRegions.begin(), openRegions.end(), k);
+	if (it != openRegions.end()) {
+		openRegions.erase(it);
+	}
+}
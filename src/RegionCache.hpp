@@ -0,0 +1,43 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <functional>
+
+#include <RegionFile.hpp>
+
+#include <explints.hpp>
+
+// Region files of a world, at most maxHandles files are kept open.
+// Every function is thread safe, chunks are read and written from TaskBuffer
+// threads. The lock here only guards the list of files, each file has its own
+class RegionCache {
+	const std::string dir;
+	const sz_t maxHandles;
+
+	std::mutex lock;
+	std::unordered_map<u64, std::shared_ptr<RegionFile>> regions;
+	std::vector<u64> openRegions; // least recently used first
+
+public:
+	RegionCache(std::string worldDir, sz_t maxHandles);
+
+	bool has(i32 chunkX, i32 chunkY);
+	std::vector<u8> read(i32 chunkX, i32 chunkY); // empty if the chunk isn't stored
+	void write(i32 chunkX, i32 chunkY, const std::vector<u8>&);
+	void erase(i32 chunkX, i32 chunkY);
+	void forEachChunkIn(i32 regionX, i32 regionY, std::function<void(i32, i32)>);
+
+	// writes the table entries of everything written before the call
+	void syncAll();
+	void closeAll();
+
+private:
+	std::string getPath(i32 regionX, i32 regionY) const;
+	std::shared_ptr<RegionFile> get(i32 chunkX, i32 chunkY, bool create);
+	void used(u64 key);
+	void removed(u64 key, const RegionFile&);
+};
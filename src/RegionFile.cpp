@@ -0,0 +1,348 @@
+#include "RegionFile.hpp"
+
+#include <cstring>
+#include <cerrno>
+#include <cstdio>
+#include <limits>
+#include <stdexcept>
+#include <iostream>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+static constexpr char regionMagic[4] = {'w', 'o', 'R', 'G'};
+static constexpr u32 regionVersion = 1;
+// magic, version, offset table
+static constexpr u64 headerSize = sizeof(regionMagic) + sizeof(u32) + RegionFile::chunksPerRegion * sizeof(u32) * 2;
+// don't bother compacting files with less garbage than this
+static constexpr u64 minWastedSize = 4 * 1024 * 1024;
+
+static void readAll(int fd, u8 * buf, sz_t size, u64 offset, const std::string& path) {
+	while (size > 0) {
+		ssize_t r = ::pread(fd, buf, size, offset);
+		if (r < 0 && errno == EINTR) {
+			continue;
+		} else if (r <= 0) {
+			throw std::runtime_error("Couldn't read region file: " + path);
+		}
+
+		buf += r;
+		size -= r;
+		offset += r;
+	}
+}
+
+static void writeAll(int fd, const u8 * buf, sz_t size, u64 offset, const std::string& path) {
+	while (size > 0) {
+		ssize_t w = ::pwrite(fd, buf, size, offset);
+		if (w < 0 && errno == EINTR) {
+			continue;
+		} else if (w <= 0) {
+			throw std::runtime_error("Couldn't write region file: " + path);
+		}
+
+		buf += w;
+		size -= w;
+		offset += w;
+	}
+}
+
+// makes a created or renamed file survive a crash
+static void syncDir(const std::string& path) {
+	sz_t slash = path.rfind('/');
+	std::string dir(slash == std::string::npos ? "." : path.substr(0, slash + 1));
+	int fd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0) {
+		throw std::runtime_error("Couldn't open directory: " + dir);
+	}
+
+	int r = ::fsync(fd);
+	::close(fd);
+	if (r != 0) {
+		throw std::runtime_error("Couldn't sync directory: " + dir);
+	}
+}
+
+RegionFile::RegionFile(std::string p)
+: path(std::move(p)),
+  fd(-1),
+  fileSize(0),
+  usedSize(headerSize),
+  unsynced(false),
+  created(false),
+  removed(false) {
+	index.fill({0, 0});
+	open();
+
+	if (fileSize < headerSize) {
+		// new file, or created right before a crash. nothing in it was
+		// referenced, the table entries are written after the data is synced
+		std::vector<u8> hdr(headerSize, 0);
+		std::memcpy(hdr.data(), regionMagic, sizeof(regionMagic));
+		std::memcpy(hdr.data() + sizeof(regionMagic), &regionVersion, sizeof(u32));
+		writeAll(fd, hdr.data(), hdr.size(), 0, path);
+		fileSize = headerSize;
+		unsynced = true;
+		created = true;
+		return;
+	}
+
+	u8 hdr[sizeof(regionMagic) + sizeof(u32)];
+	u32 version;
+	readAll(fd, hdr, sizeof(hdr), 0, path);
+	std::memcpy(&version, hdr + sizeof(regionMagic), sizeof(u32));
+	if (std::memcmp(hdr, regionMagic, sizeof(regionMagic)) != 0 || version != regionVersion) {
+		throw std::runtime_error("Invalid region file header: " + path);
+	}
+
+	readAll(fd, reinterpret_cast<u8 *>(index.data()), sizeof(Entry) * index.size(), sizeof(hdr), path);
+	for (auto& e : index) {
+		if (e.offset != 0 && (e.offset < headerSize || u64(e.offset) + e.size > fileSize)) {
+			std::cerr << "Bad offset in region file " << path << ", ignoring chunk." << std::endl;
+			e = {0, 0};
+		}
+
+		usedSize += e.size;
+	}
+}
+
+// writes the pending table entries
+RegionFile::~RegionFile() {
+	if (!removed) {
+		try {
+			sync();
+		} catch (const std::exception& e) {
+			std::cerr << e.what() << std::endl;
+		}
+	}
+
+	closeFd();
+}
+
+u32 RegionFile::indexOf(i32 chunkX, i32 chunkY) {
+	return (chunkY & (regionSize - 1)) * regionSize + (chunkX & (regionSize - 1));
+}
+
+bool RegionFile::has(u32 i) const {
+	std::lock_guard<std::mutex> _(lock);
+	return index[i].offset != 0;
+}
+
+std::vector<u8> RegionFile::read(u32 i) {
+	std::lock_guard<std::mutex> _(lock);
+	if (removed || index[i].offset == 0) {
+		return {};
+	}
+
+	open();
+	std::vector<u8> buf(index[i].size);
+	readAll(fd, buf.data(), buf.size(), index[i].offset, path);
+	return buf;
+}
+
+// readable right away, the old version stays in the table on disk until
+// the next sync
+bool RegionFile::write(u32 i, const u8 * buf, sz_t size) {
+	std::lock_guard<std::mutex> _(lock);
+	if (removed) {
+		return false;
+	}
+
+	open();
+	if (fileSize + size > std::numeric_limits<u32>::max()) {
+		compact();
+		if (fileSize + size > std::numeric_limits<u32>::max()) {
+			throw std::runtime_error("Region file is full: " + path);
+		}
+	}
+
+	writeAll(fd, buf, size, fileSize, path);
+
+	usedSize -= index[i].size;
+	index[i] = {static_cast<u32>(fileSize), static_cast<u32>(size)};
+	unsyncedEntries.set(i);
+	usedSize += size;
+	fileSize += size;
+	unsynced = true;
+
+	if (fileSize - usedSize > minWastedSize && fileSize > usedSize * 2) {
+		compact();
+	}
+
+	return true;
+}
+
+bool RegionFile::erase(u32 i) {
+	std::lock_guard<std::mutex> _(lock);
+	if (removed || index[i].offset == 0) {
+		return false;
+	}
+
+	usedSize -= index[i].size;
+	index[i] = {0, 0};
+	unsyncedEntries.set(i);
+
+	if (usedSize == headerSize) {
+		closeFd();
+		std::remove(path.c_str());
+		removed = true;
+		return true;
+	}
+
+	return false;
+}
+
+// syncs the data, then writes the table entries pointing to it and syncs
+// again. writes can keep going while the file is being synced
+void RegionFile::sync() {
+	std::unique_lock<std::mutex> lk(lock);
+	if (removed || (!unsynced && unsyncedEntries.none())) {
+		return;
+	}
+
+	open();
+	int syncFd = ::dup(fd); // this one could be closed while unlocked
+	if (syncFd < 0) {
+		throw std::runtime_error("Couldn't sync region file: " + path);
+	}
+
+	auto entries(unsyncedEntries);
+	auto synced(index);
+	bool syncDirEntry = created;
+	unsynced = false;
+	lk.unlock();
+
+	bool ok = ::fdatasync(syncFd) == 0;
+	if (ok && syncDirEntry) {
+		try {
+			syncDir(path);
+		} catch (const std::exception&) {
+			ok = false;
+		}
+	}
+
+	lk.lock();
+	if (!ok) {
+		unsynced = true;
+		::close(syncFd);
+		throw std::runtime_error("Couldn't sync region file: " + path);
+	}
+
+	created &= !syncDirEntry;
+	bool wrote = false;
+	if (!removed) {
+		for (u32 i = 0; i < chunksPerRegion; i++) {
+			// skip the ones written again, or moved by a compaction
+			if (entries[i] && index[i] == synced[i]) {
+				open();
+				writeIndexEntry(i);
+				unsyncedEntries.reset(i);
+				wrote = true;
+			}
+		}
+	}
+
+	lk.unlock();
+	ok = !wrote || ::fdatasync(syncFd) == 0;
+	::close(syncFd);
+	if (!ok) {
+		lk.lock();
+		unsynced = true;
+		throw std::runtime_error("Couldn't sync region file: " + path);
+	}
+}
+
+// the file can still be used, it's opened again when needed
+void RegionFile::close() {
+	std::lock_guard<std::mutex> _(lock);
+	closeFd();
+}
+
+bool RegionFile::isRemoved() const {
+	std::lock_guard<std::mutex> _(lock);
+	return removed;
+}
+
+void RegionFile::open() {
+	if (fd >= 0) {
+		return;
+	}
+
+	fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		throw std::runtime_error("Couldn't open region file: " + path);
+	}
+
+	struct stat st;
+	if (::fstat(fd, &st) != 0) {
+		closeFd();
+		throw std::runtime_error("Couldn't stat region file: " + path);
+	}
+
+	fileSize = st.st_size;
+}
+
+void RegionFile::closeFd() {
+	if (fd >= 0) {
+		::close(fd);
+		fd = -1;
+	}
+}
+
+void RegionFile::writeIndexEntry(u32 i) {
+	writeAll(fd, reinterpret_cast<const u8 *>(&index[i]), sizeof(Entry),
+		sizeof(regionMagic) + sizeof(u32) + i * sizeof(Entry), path);
+}
+
+// rewrites the file without the unused space, the new table has every entry.
+// rare enough that it's fine to sync with the lock held
+void RegionFile::compact() {
+	std::string tmpPath(path + ".tmp");
+	int tmp = ::open(tmpPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (tmp < 0) {
+		throw std::runtime_error("Couldn't create region file: " + tmpPath);
+	}
+
+	std::array<Entry, chunksPerRegion> newIndex;
+	u64 offset = headerSize;
+	try {
+		std::vector<u8> buf;
+		for (u32 i = 0; i < chunksPerRegion; i++) {
+			newIndex[i] = {0, 0};
+			if (index[i].offset == 0) {
+				continue;
+			}
+
+			buf.resize(index[i].size);
+			readAll(fd, buf.data(), buf.size(), index[i].offset, path);
+			writeAll(tmp, buf.data(), buf.size(), offset, tmpPath);
+			newIndex[i] = {static_cast<u32>(offset), index[i].size};
+			offset += buf.size();
+		}
+
+		u8 hdr[sizeof(regionMagic) + sizeof(u32)];
+		std::memcpy(hdr, regionMagic, sizeof(regionMagic));
+		std::memcpy(hdr + sizeof(regionMagic), &regionVersion, sizeof(u32));
+		writeAll(tmp, hdr, sizeof(hdr), 0, tmpPath);
+		writeAll(tmp, reinterpret_cast<const u8 *>(newIndex.data()), sizeof(Entry) * newIndex.size(), sizeof(hdr), tmpPath);
+
+		if (::fsync(tmp) != 0 || std::rename(tmpPath.c_str(), path.c_str()) != 0) {
+			throw std::runtime_error("Couldn't replace region file: " + path);
+		}
+	} catch (...) {
+		::close(tmp);
+		std::remove(tmpPath.c_str());
+		throw;
+	}
+
+	::close(tmp);
+	closeFd();
+	index = newIndex;
+	usedSize = offset;
+	unsyncedEntries.reset();
+	unsynced = false;
+	open();
+	syncDir(path);
+	created = false;
+}
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <array>
+#include <bitset>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <explints.hpp>
+
+// Packs many chunk files in one file, with an offset table at the start.
+// Chunks are always appended, the file is compacted when too much space is wasted.
+// Writes only append the data, the offset table entries pointing to it are
+// written by sync(), after the data is on disk, so a crash keeps the previous
+// version. Thread safe, the lock is never held while syncing. Doesn't limit
+// open files by itself, see RegionCache
+class RegionFile {
+public:
+	static constexpr u32 regionShift = 5;
+	static constexpr u32 regionSize = 1 << regionShift; // in chunks, per side
+	static constexpr u32 chunksPerRegion = regionSize * regionSize;
+
+private:
+	struct Entry {
+		u32 offset; // 0 if not present
+		u32 size;
+
+		bool operator ==(const Entry& e) const {
+			return offset == e.offset && size == e.size;
+		}
+	};
+
+	mutable std::mutex lock;
+	const std::string path;
+	std::array<Entry, chunksPerRegion> index; // latest, the file has the synced one
+	std::bitset<chunksPerRegion> unsyncedEntries;
+	int fd;
+	u64 fileSize;
+	u64 usedSize; // header and live chunks
+	bool unsynced; // data written since the last fdatasync
+	bool created; // the directory entry wasn't synced yet
+	bool removed; // deleted when it became empty, get a new one
+
+public:
+	RegionFile(std::string path);
+	~RegionFile();
+
+	RegionFile(const RegionFile&) = delete;
+
+	static u32 indexOf(i32 chunkX, i32 chunkY);
+
+	bool has(u32 i) const;
+	std::vector<u8> read(u32 i);
+	// returns false if the file was removed, and nothing was written
+	bool write(u32 i, const u8 *, sz_t);
+	// returns true if the file became empty, and was removed
+	bool erase(u32 i);
+
+	void sync();
+	void close();
+	bool isRemoved() const;
+
+private:
+	void open();
+	void writeIndexEntry(u32 i);
+	void compact();
+	void closeFd();
+};
@@ -0,0 +1,63 @@
+#include "SaveProgress.hpp"
+
+#include <iostream>
+
+#include <nlohmann/json.hpp>
+
+SaveProgress::SaveProgress()
+: lastDuration(0),
+  pending(0),
+  chunks(0),
+  failed(0),
+  bytes(0),
+  saveCount(0) { }
+
+// the first task queued starts a new save
+void SaveProgress::taskQueued() {
+	if (pending++ == 0) {
+		started = std::chrono::steady_clock::now();
+		chunks = 0;
+		failed = 0;
+		bytes = 0;
+	}
+}
+
+void SaveProgress::chunkWritten(sz_t b) {
+	++chunks;
+	bytes += b;
+}
+
+void SaveProgress::chunkFailed() {
+	++failed;
+}
+
+void SaveProgress::taskDone() {
+	if (--pending != 0) {
+		return;
+	}
+
+	++saveCount;
+	lastDuration = std::chrono::steady_clock::now() - started;
+	std::cout << "Saved " << chunks << " chunks (" << bytes / 1024 << " KiB, "
+		<< failed << " failed) in " << lastDuration.count() << "ms" << std::endl;
+}
+
+bool SaveProgress::isRunning()                       const { return pending != 0; }
+u32 SaveProgress::getPendingTasks()                  const { return pending; }
+u64 SaveProgress::getChunksWritten()                 const { return chunks; }
+u64 SaveProgress::getChunksFailed()                  const { return failed; }
+u64 SaveProgress::getBytesWritten()                  const { return bytes; }
+u64 SaveProgress::getSaveCount()                     const { return saveCount; }
+SaveProgress::FloatMillis SaveProgress::getLastDuration() const { return lastDuration; }
+
+void to_json(nlohmann::json& j, const SaveProgress& s) {
+	j = {
+		{ "running", s.isRunning() },
+		{ "pending", s.getPendingTasks() },
+		{ "chunksWritten", s.getChunksWritten() },
+		{ "chunksFailed", s.getChunksFailed() },
+		{ "bytesWritten", s.getBytesWritten() },
+		{ "saves", s.getSaveCount() },
+		{ "lastDurationMs", s.getLastDuration().count() }
+	};
+}
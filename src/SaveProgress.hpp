@@ -0,0 +1,41 @@
+#pragma once
+
+#include <chrono>
+
+#include <explints.hpp>
+
+#include <nlohmann/json_fwd.hpp>
+
+// Progress and duration of the world saves, shared by every world. Chunks
+// are written by TaskBuffer workers, a save ends when the last task is done
+class SaveProgress {
+public:
+	using FloatMillis = std::chrono::duration<float, std::milli>;
+
+private:
+	std::chrono::steady_clock::time_point started;
+	FloatMillis lastDuration;
+	u32 pending; // chunk writes and region syncs
+	u64 chunks; // written in the current or last save
+	u64 failed;
+	u64 bytes;
+	u64 saveCount;
+
+public:
+	SaveProgress();
+
+	void taskQueued();
+	void chunkWritten(sz_t bytes);
+	void chunkFailed();
+	void taskDone();
+
+	bool isRunning() const;
+	u32 getPendingTasks() const;
+	u64 getChunksWritten() const;
+	u64 getChunksFailed() const;
+	u64 getBytesWritten() const;
+	u64 getSaveCount() const;
+	FloatMillis getLastDuration() const;
+};
+
+void to_json(nlohmann::json&, const SaveProgress&);
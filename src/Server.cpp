@@ -16,6 +16,7 @@
 #include <HeaderChecker.hpp>
 #include <CaptchaChecker.hpp>
 #include <ProxyChecker.hpp>
+#include <AdmissionChecker.hpp>
 
 #include <iostream>
 #include <utility>
@@ -23,9 +24,12 @@
 #include <new>
 #include <initializer_list>
 #include <string_view>
+#include <algorithm>
 
 #include <nlohmann/json.hpp>
 
+#include <config.hpp>
+
 constexpr auto asyncDeleter = [] (uS::Async * a) {
 	a->close();
 };
@@ -52,7 +56,8 @@ Server::Server(std::string basePath)
   ac(h.getLoop()),
   pr(h, [] (Client& c) { c.updateLastActionTime(); }), // for every packet
   saveTimer(0),
-  statsTimer(0) {
+  statsTimer(0),
+  memoryTimer(0) {
 	stopCaller->setData(this);
 	tb.setWorkerThreadsSchedulingPriorityToLowestPossibleValueAllowedByTheOperatingSystem();
 
@@ -152,6 +157,9 @@ Server::Server(std::string basePath)
 		return new Client(ic.ws, std::move(ic.ci.session), ic.ip, pb);
 	});
 
+	// admits sockets before their handshake is parsed, see ConnectionProcessor::admit
+	conn.addToBeg<AdmissionChecker>();
+
 	h.getDefaultGroup<uWS::SERVER>().startAutoPing(30000);
 }
 
@@ -172,12 +180,17 @@ bool Server::listenAndRun() {
 	saveTimer = tc.startTimer([this] {
 		kickInactivePlayers();
 		if (wm.saveAll()) {
-			std::cout << "Worlds saved." << std::endl;
+			std::cout << "Saving worlds..." << std::endl;
 		}
 		
 		return true;
 	}, 900000);
 
+	memoryTimer = tc.startTimer([this] {
+		checkMemory();
+		return true;
+	}, SERVER_MEMORY_CHECK_MSEC);
+
 	stopCaller->start(Server::doStop);
 
 	try {
@@ -193,15 +206,38 @@ bool Server::listenAndRun() {
 	return true;
 }
 
-bool Server::freeMemory() {
-	if (wm.unloadOldChunks() == 0
-		&& wm.unloadOldChunks(true) == 0
+void Server::checkMemory() {
+	mem.setUsage(getMemoryUsage());
+	MemoryMonitor::Pressure p = mem.poll();
+	if (!mem.adjustBudgets()) {
+		return;
+	}
 
-	) {
-		return false;
+	MemoryMonitor::Usage before(mem.getUsage());
+	u64 held = before.chunks + before.pngCaches;
+	// the least recently used are evicted, down to the new budgets
+	wm.setCacheBudgets(mem.getChunkBudgetPercent(), mem.getPngBudgetPercent());
+	wm.evictPngCaches();
+	wm.evictChunks();
+
+	MemoryMonitor::Usage after(getMemoryUsage());
+	u64 left = after.chunks + after.pngCaches;
+	if (p != MemoryMonitor::Pressure::NONE) {
+		mem.shed(p, held - std::min(held, left));
 	}
 
-	return true;
+	mem.setUsage(after);
+}
+
+// estimated, the chunk numbers are from the last cache eviction
+MemoryMonitor::Usage Server::getMemoryUsage() const {
+	const ChunkCache& cache = wm.getChunkCache();
+	return {
+		cache.getUsedBytes(),
+		cache.getPngUsedBytes(),
+		conn.pendingCount() * sizeof(IncomingConnection),
+		am.sessionCount() * (sizeof(Session) + sizeof(User))
+	};
 }
 
 void Server::kickInactivePlayers() {
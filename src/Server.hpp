@@ -12,6 +12,7 @@
 #include <WorldManager.hpp>
 #include <ApiProcessor.hpp>
 #include <AuthManager.hpp>
+#include <MemoryMonitor.hpp>
 
 #include <PacketReader.hpp>
 #include <explints.hpp>
@@ -44,15 +45,17 @@ class Server {
 	ApiProcessor api;
 	AsyncCurl ac;
 	PacketReader<Client> pr;
+	MemoryMonitor mem;
 
 	u32 saveTimer;
 	u32 statsTimer;
+	u32 memoryTimer;
 
 public:
 	Server(std::string basePath = ".");
 
 	bool listenAndRun();
-	bool freeMemory();
+	void checkMemory();
 	void kickInactivePlayers();
 	void stop();
 
@@ -60,6 +63,7 @@ private:
 	void registerNotifs();
 	void registerEndpoints();
 	void registerPackets();
+	MemoryMonitor::Usage getMemoryUsage() const;
 	static void doStop(uS::Async *);
 	void unsafeStop();
 };
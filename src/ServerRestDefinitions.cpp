@@ -1,6 +1,7 @@
 #include "Server.hpp"
 
 #include <iostream>
+#include <charconv>
 
 #include <WorldManager.hpp>
 #include <User.hpp>
@@ -103,10 +104,17 @@ void Server::registerEndpoints() {
 		.path("view")
 		.var()
 		.var()
-		/*.var()*/
-	.end([this] (ll::shared_ptr<Request> req, std::string_view, std::string worldName, i32 x, i32 y/*, u8 downscaling*/) {
-		if (!wm.verifyWorldName(worldName)/* || downscaling > 16 || downscaling == 0
-				|| (downscaling & (downscaling - 1)) != 0*/) { // not power of 2
+	.end([this] (ll::shared_ptr<Request> req, std::string_view, std::string worldName, i32 x, i32 y) {
+		// optional ?downscaling=, for zoomed out views
+		u32 downscaling = 1;
+		bool badDownscaling = false;
+		if (auto d = req->getQueryParam("downscaling")) {
+			auto res = std::from_chars(d->data(), d->data() + d->size(), downscaling);
+			badDownscaling = res.ec != std::errc() || res.ptr != d->data() + d->size();
+		}
+
+		if (!wm.verifyWorldName(worldName) || badDownscaling || downscaling > (1 << TilePyramid::maxLevel)
+				|| downscaling == 0 || (downscaling & (downscaling - 1)) != 0) { // not power of 2
 			req->writeStatus("400 Bad Request");
 			req->end();
 			return;
@@ -123,7 +131,7 @@ void Server::registerEndpoints() {
 		World& world = wm.getOrLoadWorld(worldName);
 
 		// will encode the png in another thread if necessary and end the request when done
-		world.sendChunk(x, y, /*downscaling,*/ std::move(req));
+		world.sendChunk(x, y, downscaling, std::move(req));
 	});
 
 	api.on(ApiProcessor::MPOST) // Switch world
@@ -322,7 +330,10 @@ void Server::registerEndpoints() {
 			{ "uptime", std::chrono::duration_cast<std::chrono::seconds>(std::chrono::steady_clock::now() - startupTime).count() }, // lol
 			{ "yourIp", ip },
 			{ "banned", banned },
-			{ "tps", wm.getTps() }
+			{ "tps", wm.getTps() },
+			{ "chunkCache", wm.getChunkCache() },
+			{ "memory", mem },
+			{ "save", wm.getSaveProgress() }
 		};
 
 		nlohmann::json processorInfo;
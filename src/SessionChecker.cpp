@@ -23,8 +23,11 @@ bool SessionChecker::preCheck(IncomingConnection& ic, HttpData hd) {
 
 		if (!ic.ci.session) {
 			// store the token somewhere else, since the http data will be
-			// deleted when we reach the async checks
-			ic.args.insert_or_assign("uviastoken", std::string(*tok));
+			// deleted when we reach the async checks. too long to be valid
+			// if it doesn't fit
+			if (!ic.args.set("uviastoken", *tok)) {
+				return false;
+			}
 		}
 	}
 
@@ -33,13 +36,13 @@ bool SessionChecker::preCheck(IncomingConnection& ic, HttpData hd) {
 }
 
 void SessionChecker::asyncCheck(IncomingConnection& ic, std::function<void(bool)> cb) {
-	auto it = ic.args.find("uviastoken");
-	if (it == ic.args.end()) {
+	auto tok = ic.args.get("uviastoken");
+	if (!tok) {
 		cb(false);
 		return;
 	}
 
-	auto cancel = am.loadSession(it->second, [&ic, cb{std::move(cb)}] (auto ses) {
+	auto cancel = am.loadSession(*tok, [&ic, cb{std::move(cb)}] (auto ses) {
 		ic.ci.session = std::move(ses);
 		// only continue if the session is valid
 		cb(bool(ic.ci.session));
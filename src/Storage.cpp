@@ -11,6 +11,7 @@
 #include <array>
 
 #include <Chunk.hpp>
+#include <config.hpp>
 
 #include <PngImage.hpp>
 #include <rle.hpp>
@@ -30,16 +31,8 @@ static twoi32 mk_twoi32(i32 x, i32 y) {
 	return u;
 }
 
-WorldStorage::WorldStorage(std::string worldDir, std::string worldName)
-: PropertyReader(worldDir + "/props.txt"),
-  worldDir(std::move(worldDir)),
-  worldName(std::move(worldName)) {
-	if (!fileExists(this->worldDir) && !makeDir(this->worldDir)) {
-		throw std::runtime_error("Couldn't create world directory: " + this->worldDir);
-	}
-
-	loadProtectionData();
-	std::string pattern(this->worldDir + "/r.*.pxr");
+// calls f with the two numbers after the prefix, of every file matching the pattern
+static void globPositions(const std::string& pattern, sz_t prefixLen, std::function<void(i32, i32)> f) {
 	glob_t result; // XXX: careful with exceptions here
 	if (int err = glob(pattern.c_str(), GLOB_NOSORT, nullptr, &result)) {
 		if (err != GLOB_NOMATCH) {
@@ -48,21 +41,41 @@ WorldStorage::WorldStorage(std::string worldDir, std::string worldName)
 		return;
 	}
 
-	sz_t s = this->worldDir.size() + 3;
 	for (sz_t i = 0; i < result.gl_pathc; i++) {
 		char * c = result.gl_pathv[i];
-		// we can assume that the string will be as long
-		// as this path + "/r."
-		c += s;
-		twoi32 pos;
-		pos.x = std::strtol(c, &c, 10);
-		pos.y = std::strtol(c + 1, &c, 10);
-		remainingOldClusters.emplace(pos);
+		c += prefixLen;
+		i32 x = std::strtol(c, &c, 10);
+		i32 y = std::strtol(c + 1, &c, 10);
+		f(x, y);
 	}
 
 	globfree(&result);
+}
+
+WorldStorage::WorldStorage(std::string worldDir, std::string worldName)
+: PropertyReader(worldDir + "/props.txt"),
+  worldDir(std::move(worldDir)),
+  worldName(std::move(worldName)),
+  regions(this->worldDir, WORLD_MAX_FILE_HANDLES),
+  pixelLog(this->worldDir),
+  replayedLogSegment(0) {
+	if (!fileExists(this->worldDir) && !makeDir(this->worldDir)) {
+		throw std::runtime_error("Couldn't create world directory: " + this->worldDir);
+	}
+
+	settings.bgColor = parseBackgroundColor();
+	settings.pixelRate = parsePixelRate();
+	loadProtectionData();
+	loadChunkIndex();
+
+	// we can assume that the string will be as long
+	// as this path + "/r."
+	globPositions(this->worldDir + "/r.*.pxr", this->worldDir.size() + 3, [this] (i32 x, i32 y) {
+		remainingOldClusters.emplace(mk_twoi32(x, y));
+	});
 
 	std::cout << "World " << getWorldName() << " has " << remainingOldClusters.size() << " old clusters left" << std::endl;
+	replayPixelLog();
 }
 
 WorldStorage::WorldStorage(std::tuple<std::string, std::string> args)
@@ -70,6 +83,13 @@ WorldStorage::WorldStorage(std::tuple<std::string, std::string> args)
 
 WorldStorage::~WorldStorage() {
 	saveProtectionData();
+	// the chunks of World were saved when destroyed, before this
+	try {
+		regions.syncAll();
+		pixelLog.discardBefore(pixelLog.rotate());
+	} catch (const std::exception& e) {
+		std::cerr << "Couldn't sync regions of world " << getWorldName() << ": " << e.what() << std::endl;
+	}
 }
 
 const std::string& WorldStorage::getWorldName() const {
@@ -80,8 +100,8 @@ const std::string& WorldStorage::getWorldDir() const {
 	return worldDir;
 }
 
-std::string WorldStorage::getChunkFilePath(i32 x, i32 y) const {
-	return worldDir + "/r." + std::to_string(x) + "." + std::to_string(y) + ".png";
+std::string WorldStorage::getChunkFilePath(i32 x, i32 y, EChunkFormat fmt) const {
+	return worldDir + "/r." + std::to_string(x) + "." + std::to_string(y) + (fmt == C_RAW ? ".rgbz" : ".png");
 }
 
 EChunkFormat WorldStorage::isChunkOnDisk(i32 x, i32 y) const {
@@ -89,11 +109,58 @@ EChunkFormat WorldStorage::isChunkOnDisk(i32 x, i32 y) const {
 	static_assert(Chunk::size == 512, "Chunk::size is not 512, this function won't work");
 	if (remainingOldClusters.find(mk_twoi32(x, y)) != remainingOldClusters.end()) {
 		return C_PXR;
-	} else if (fileExists(worldDir + "/r." + std::to_string(x) + "." + std::to_string(y) + ".png")) {
-		return C_PNG;
 	}
 
-	return C_NONE;
+	auto search = chunksOnDisk.find(mk_twoi32(x, y).pos);
+	return search != chunksOnDisk.end() ? search->second : C_NONE;
+}
+
+void WorldStorage::setChunkOnDisk(i32 x, i32 y, EChunkFormat fmt) {
+	if (fmt == C_NONE) {
+		chunksOnDisk.erase(mk_twoi32(x, y).pos);
+	} else {
+		chunksOnDisk.insert_or_assign(mk_twoi32(x, y).pos, fmt);
+	}
+}
+
+RegionCache& WorldStorage::getRegionCache() const {
+	return regions;
+}
+
+PixelLog& WorldStorage::getPixelLog() {
+	return pixelLog;
+}
+
+const PixelLog& WorldStorage::getPixelLog() const {
+	return pixelLog;
+}
+
+const std::vector<u64>& WorldStorage::getReplayedChunks() const {
+	return replayedChunks;
+}
+
+void WorldStorage::replayedChunksMarked() {
+	if (replayedLogSegment != 0) {
+		pixelLog.discardBefore(replayedLogSegment);
+	}
+
+	std::vector<u64>().swap(replayedChunks);
+	replayedLogSegment = 0;
+}
+
+const std::unordered_map<u64, std::vector<pixupd_t>>& WorldStorage::getUnreplayedPixels() const {
+	return unreplayedPixels;
+}
+
+std::vector<pixupd_t> WorldStorage::takeUnreplayedPixels(u64 k) {
+	auto search = unreplayedPixels.find(k);
+	if (search == unreplayedPixels.end()) {
+		return {};
+	}
+
+	std::vector<pixupd_t> pixels(std::move(search->second));
+	unreplayedPixels.erase(search);
+	return pixels;
 }
 
 bool WorldStorage::save() {
@@ -108,7 +175,19 @@ bool WorldStorage::hasPassword() {
 	return hasProp("password");
 }
 
-u16 WorldStorage::getPixelRate() {
+const WorldSettings& WorldStorage::getSettings() const {
+	return settings;
+}
+
+u16 WorldStorage::getPixelRate() const {
+	return settings.pixelRate;
+}
+
+RGB_u WorldStorage::getBackgroundColor() const {
+	return settings.bgColor;
+}
+
+u16 WorldStorage::parsePixelRate() const {
 	try {
 		return fromString<u16>(getProp("paintrate", "32"));
 	} catch(const std::exception& e) {
@@ -118,7 +197,7 @@ u16 WorldStorage::getPixelRate() {
 	return 32;
 }
 
-RGB_u WorldStorage::getBackgroundColor() const {
+RGB_u WorldStorage::parseBackgroundColor() const {
 	RGB_u clr = {.rgb = 0xFFFFFFFF};
 	if (hasProp("bgcolor")) try {
 		std::string s(getProp("bgcolor"));
@@ -153,20 +232,35 @@ std::string_view WorldStorage::getPassword() {
 
 void WorldStorage::setPixelRate(u16 v) {
 	setProp("paintrate", std::to_string(v));
+	settings.pixelRate = v;
+	settingsChanged();
 }
 
 void WorldStorage::setBackgroundColor(RGB_u clr) {
 	setProp("bgcolor", std::string("0x") + n2hexstr(clr.rgb));
+	settings.bgColor = clr;
+	settingsChanged();
 }
 
 void WorldStorage::setMotd(std::string s) {
 	setProp("motd", std::move(s));
+	settingsChanged();
 }
 
 void WorldStorage::setPassword(std::string s) {
 	setProp("password", std::move(s));
 }
 
+void WorldStorage::setSettingsChangedFunc(std::function<void()> f) {
+	onSettingsChanged = std::move(f);
+}
+
+void WorldStorage::settingsChanged() {
+	if (onSettingsChanged) {
+		onSettingsChanged();
+	}
+}
+
 void WorldStorage::convertNext() {
 	if (remainingOldClusters.size() == 0) return;
 	twoi32 p = *remainingOldClusters.begin();
@@ -282,11 +376,97 @@ void WorldStorage::maybeConvert(i32 x, i32 y) {
 					return rle::compress(prtect.data(), prtect.size());
 				});
 				result.writeFile(path); // scoped array, can't fall through
+				setChunkOnDisk(chunkx, chunky, C_PNG);
 				continue;
 			}
 			result.writeFile(path);
+			setChunkOnDisk(chunkx, chunky, C_PNG);
+		}
+	}
+}
+
+void WorldStorage::loadChunkIndex() {
+	// the region files have priority over the old per-chunk files
+	globPositions(worldDir + "/r.*.png", worldDir.size() + 3, [this] (i32 x, i32 y) {
+		chunksOnDisk.insert_or_assign(mk_twoi32(x, y).pos, C_PNG);
+	});
+
+	globPositions(worldDir + "/r.*.rgbz", worldDir.size() + 3, [this] (i32 x, i32 y) {
+		chunksOnDisk.insert_or_assign(mk_twoi32(x, y).pos, C_RAW);
+	});
+
+	globPositions(worldDir + "/region.*.bin", worldDir.size() + 8, [this] (i32 rx, i32 ry) {
+		try {
+			regions.forEachChunkIn(rx, ry, [this] (i32 x, i32 y) {
+				chunksOnDisk.insert_or_assign(mk_twoi32(x, y).pos, C_REGION);
+			});
+		} catch (const std::runtime_error& e) {
+			std::cerr << "Couldn't read region " << rx << ", " << ry << " of world "
+				<< getWorldName() << ": " << e.what() << std::endl;
+		}
+	});
+
+	std::cout << "World " << getWorldName() << " has " << chunksOnDisk.size() << " chunks on disk" << std::endl;
+}
+
+// applies the pixels painted after the last save, if the server crashed
+void WorldStorage::replayPixelLog() {
+	std::map<u64, std::vector<pixupd_t>> changes;
+	sz_t count = 0;
+	pixelLog.forEachRecord([&changes, &count] (const pixupd_t& p) {
+		changes[mk_twoi32(p.x >> Chunk::posShift, p.y >> Chunk::posShift).pos].push_back(p);
+		++count;
+	});
+
+	if (changes.empty()) {
+		return;
+	}
+
+	RGB_u bg = getBackgroundColor();
+	bool ok = true;
+	for (auto& c : changes) {
+		twoi32 pos;
+		pos.pos = c.first;
+		replayedChunks.push_back(c.first);
+		try {
+			maybeConvertChunk(pos.x, pos.y);
+			Chunk chunk(pos.x, pos.y, *this);
+			chunk.load(bg);
+			for (const auto& p : c.second) {
+				RGB_u clr = bg;
+				clr.r = p.r;
+				clr.g = p.g;
+				clr.b = p.b;
+				chunk.setPixel(p.x, p.y, clr);
+			}
+
+			chunk.save();
+		} catch (const std::exception& e) {
+			std::cerr << "Couldn't replay pixels of chunk " << pos.x << ", " << pos.y
+				<< " in world " << getWorldName() << ": " << e.what() << std::endl;
+			// tried again when the world loads the chunk
+			unreplayedPixels.emplace(c.first, std::move(c.second));
+			ok = false;
+		}
+	}
+
+	if (ok) {
+		try {
+			regions.syncAll();
+		} catch (const std::exception& e) {
+			std::cerr << "Couldn't sync regions of world " << getWorldName() << ": " << e.what() << std::endl;
+			ok = false;
 		}
 	}
+
+	if (ok) {
+		replayedLogSegment = pixelLog.rotate();
+	} else {
+		pixelLog.chunkSaveFailed();
+	}
+
+	std::cout << "Replayed " << count << " pixels in " << changes.size()
+		<< " chunks of world " << getWorldName() << std::endl;
 }
 
 void WorldStorage::saveProtectionData() {
@@ -380,6 +560,14 @@ std::string_view Storage::getDefaultWorldName() const {
 	return getProp("server.worlds.default");
 }
 
+u64 Storage::getChunkCacheSize() const {
+	return fromString<u64>(getProp("server.worlds.chunkcachemb")) * 1024 * 1024;
+}
+
+u64 Storage::getPngCacheSize() const {
+	return fromString<u64>(getProp("server.worlds.pngcachemb")) * 1024 * 1024;
+}
+
 void Storage::setBindAddress(std::string s) {
 	setProp("server.bindto", std::move(s));
 }
@@ -392,6 +580,14 @@ void Storage::setDefaultWorldName(std::string s) {
 	setProp("server.worlds.default", std::move(s));
 }
 
+void Storage::setChunkCacheSize(u64 bytes) {
+	setProp("server.worlds.chunkcachemb", std::to_string(bytes / 1024 / 1024));
+}
+
+void Storage::setPngCacheSize(u64 bytes) {
+	setProp("server.worlds.pngcachemb", std::to_string(bytes / 1024 / 1024));
+}
+
 BansManager& Storage::getBansManager() {
 	return bm;
 }
@@ -405,5 +601,8 @@ void Storage::populateConfigFile() {
 	getOrSetProp("server.port", "13375");
 	getOrSetProp("server.worlds.folder", "world_data");
 	getOrSetProp("server.worlds.default", "main");
+	// decoded chunk data is 3 bytes per pixel
+	getOrSetProp("server.worlds.chunkcachemb", std::to_string(WORLD_MAX_CHUNKS_LOADED * Chunk::size * Chunk::size * 3 / 1024 / 1024));
+	getOrSetProp("server.worlds.pngcachemb", std::to_string(WORLD_PNG_CACHE_MB));
 }
 
@@ -7,8 +7,11 @@
 #include <vector>
 #include <map>
 #include <set>
+#include <unordered_map>
 
 #include <BansManager.hpp>
+#include <RegionCache.hpp>
+#include <PixelLog.hpp>
 
 #include <explints.hpp>
 #include <PropertyReader.hpp>
@@ -30,15 +33,36 @@ bool operator<(const twoi32& a, const twoi32& b);
 enum EChunkFormat {
 	C_NONE = 0,
 	C_PXR,
-	C_PNG
+	C_PNG,
+	C_RAW, // zlib compressed rgb, see Chunk.cpp
+	C_REGION // C_RAW data, inside a region file
+};
+
+// world properties that are read often, parsed once from props.txt
+// and kept in sync by the setters
+struct WorldSettings {
+	RGB_u bgColor;
+	u16 pixelRate;
 };
 
 class WorldStorage : PropertyReader {
 	const std::string worldDir; // path for the world files
 	const std::string worldName;
+	mutable RegionCache regions;
+	PixelLog pixelLog;
 
 	std::map<u64, std::vector<twoi32>> pclust;
 	std::set<twoi32> remainingOldClusters;
+	// every chunk saved on disk, so that lookups don't need to stat files
+	std::unordered_map<u64, EChunkFormat> chunksOnDisk;
+	// chunks changed by replaying the pixel log, and the segment the log can
+	// be discarded before once their tiles are marked. 0 keeps the log
+	std::vector<u64> replayedChunks;
+	u32 replayedLogSegment;
+	// pixels of the chunks that failed to replay, by chunk
+	std::unordered_map<u64, std::vector<pixupd_t>> unreplayedPixels;
+	WorldSettings settings;
+	std::function<void()> onSettingsChanged;
 
 	// worldDir = directory of this world's data
 	WorldStorage(std::string worldDir, std::string worldName);
@@ -53,15 +77,27 @@ public:
 
 	const std::string& getWorldName() const;
 	const std::string& getWorldDir() const;
-	std::string getChunkFilePath(i32 x, i32 y) const;
+	std::string getChunkFilePath(i32 x, i32 y, EChunkFormat fmt = C_PNG) const;
 	EChunkFormat isChunkOnDisk(i32 x, i32 y) const;
+	void setChunkOnDisk(i32 x, i32 y, EChunkFormat);
+	RegionCache& getRegionCache() const;
+	PixelLog& getPixelLog();
+	const PixelLog& getPixelLog() const;
+	// the tiles over these chunks are outdated, call replayedChunksMarked
+	// once they're marked to discard the replayed log
+	const std::vector<u64>& getReplayedChunks() const;
+	void replayedChunksMarked();
+	// the log is kept while these aren't applied to their chunks and saved
+	const std::unordered_map<u64, std::vector<pixupd_t>>& getUnreplayedPixels() const;
+	std::vector<pixupd_t> takeUnreplayedPixels(u64 chunkKey);
 
 	bool save();
 
 	bool hasMotd();
 	bool hasPassword();
 
-	u16 getPixelRate();
+	const WorldSettings& getSettings() const;
+	u16 getPixelRate() const;
 	RGB_u getBackgroundColor() const;
 	std::string_view getMotd() const;
 	std::string_view getPassword();
@@ -70,13 +106,22 @@ public:
 	void setBackgroundColor(RGB_u);
 	void setMotd(std::string);
 	void setPassword(std::string);
+	// called after the settings or the motd change
+	void setSettingsChangedFunc(std::function<void()>);
 
 	void convertNext();
 	void maybeConvertChunk(i32, i32);
 	void maybeConvert(i32, i32);
+	void loadChunkIndex();
+	void replayPixelLog();
 	void loadProtectionData();
 	void saveProtectionData();
 
+private:
+	u16 parsePixelRate() const;
+	RGB_u parseBackgroundColor() const;
+	void settingsChanged();
+
 	friend World;
 };
 
@@ -99,10 +144,14 @@ public:
 	std::string_view getBindAddress() const;
 	u16 getBindPort() const;
 	std::string_view getDefaultWorldName() const;
+	u64 getChunkCacheSize() const; // in bytes
+	u64 getPngCacheSize() const; // in bytes
 
 	void setBindAddress(std::string);
 	void setBindPort(u16);
 	void setDefaultWorldName(std::string);
+	void setChunkCacheSize(u64);
+	void setPngCacheSize(u64);
 
 	BansManager& getBansManager();
 	std::tuple<std::string, std::string> getWorldStorageArgsFor(const std::string& worldName);
@@ -0,0 +1,437 @@
+#include "TilePyramid.hpp"
+
+#include <World.hpp>
+#include <Chunk.hpp>
+#include <Storage.hpp>
+
+#include <TaskBuffer.hpp>
+#include <PngImage.hpp>
+#include <utils.hpp>
+
+#include <iostream>
+#include <fstream>
+#include <cstdio>
+#include <cstdlib>
+#include <stdexcept>
+#include <glob.h>
+
+#include <zlib.h>
+
+static constexpr u32 halfSize = Chunk::size / 2;
+
+struct TilePyramid::Build {
+	u32 level;
+	i32 x;
+	i32 y;
+	u8 dirty; // quadrants to downscale again
+	bool reuseOld; // only replace the dirty quadrants of the tile on disk
+	bool failed; // the tile is incomplete, and wasn't written
+	RGB_u bg;
+	std::string path;
+	std::array<TileRef, 4> quadrants; // nullptr if there's nothing drawn
+	u32 pending;
+};
+
+static u64 tileKey(i32 x, i32 y) {
+	twoi32 u;
+	u.x = x;
+	u.y = y;
+
+	return u.pos;
+}
+
+// averages every 2x2 pixels of a Chunk::size square
+template<typename Fn>
+static void halve(std::vector<u8>& out, Fn getPixel) {
+	out.resize(halfSize * halfSize * 3);
+	u8 * p = out.data();
+	for (u32 y = 0; y < halfSize; y++) {
+		for (u32 x = 0; x < halfSize; x++) {
+			RGB_u a = getPixel(x * 2, y * 2);
+			RGB_u b = getPixel(x * 2 + 1, y * 2);
+			RGB_u c = getPixel(x * 2, y * 2 + 1);
+			RGB_u d = getPixel(x * 2 + 1, y * 2 + 1);
+			*p++ = (a.r + b.r + c.r + d.r + 2) / 4;
+			*p++ = (a.g + b.g + c.g + d.g + 2) / 4;
+			*p++ = (a.b + b.b + c.b + d.b + 2) / 4;
+		}
+	}
+}
+
+static std::vector<u8> readTileFile(const std::string& path) {
+	std::vector<u8> data;
+	std::ifstream f(path, std::ios::binary | std::ios::ate);
+	if (f) {
+		data.resize(f.tellg());
+		f.seekg(0);
+		if (!f.read(reinterpret_cast<char *>(data.data()), data.size())) {
+			data.clear();
+		}
+	}
+
+	return data;
+}
+
+static bool writeTileFile(const std::string& path, const std::vector<u8>& data) {
+	std::string tmp(path + ".tmp");
+	{
+		std::ofstream f(tmp, std::ios::binary | std::ios::trunc);
+		if (!f.write(reinterpret_cast<const char *>(data.data()), data.size())) {
+			return false;
+		}
+	}
+
+	return std::rename(tmp.c_str(), path.c_str()) == 0;
+}
+
+TilePyramid::TilePyramid(World& w, TaskBuffer& tb, std::string worldDir)
+: w(w),
+  tb(tb),
+  dir(std::move(worldDir) + "/tiles"),
+  buildCount(0),
+  marksChanged(false) {
+	if (!fileExists(dir) && !makeDir(dir)) {
+		throw std::runtime_error("Couldn't create tiles directory: " + dir);
+	}
+
+	loadMarks();
+}
+
+void TilePyramid::setIdleFunc(std::function<void()> f) {
+	onIdle = std::move(f);
+}
+
+void TilePyramid::chunkChanged(i32 chunkX, i32 chunkY) {
+	markAbove(0, chunkX, chunkY);
+}
+
+void TilePyramid::getTile(u32 level, i32 x, i32 y, std::function<void(TileRef)> cb) {
+	if (isAreaEmpty(level, x, y)) {
+		cb(nullptr);
+		return;
+	}
+
+	build(level, x, y, std::move(cb));
+}
+
+std::optional<std::string> TilePyramid::getStoredTilePath(u32 level, i32 x, i32 y) const {
+	u64 k = tileKey(x, y);
+	auto search = tiles[level - 1].find(k);
+	if (search == tiles[level - 1].end() || (search->second & (onDiskBit | dirtyBits)) != onDiskBit
+			|| building[level - 1].find(k) != building[level - 1].end()) {
+		return std::nullopt;
+	}
+
+	return getTilePath(level, x, y);
+}
+
+// builds the whole tile again on the next request
+void TilePyramid::tileFileMissing(u32 level, i32 x, i32 y) {
+	tiles[level - 1][tileKey(x, y)] = dirtyBits;
+	marksChanged = true;
+}
+
+bool TilePyramid::isBusy() const {
+	return buildCount != 0;
+}
+
+// writes the changed quadrants of every tile, so they're not lost on restarts
+bool TilePyramid::save() {
+	if (!marksChanged) {
+		return false;
+	}
+
+	std::ofstream f(dir + "/dirty.bin", std::ios::binary | std::ios::trunc);
+	for (u8 level = 1; level <= maxLevel; level++) {
+		for (const auto& tile : tiles[level - 1]) {
+			u8 dirty = tile.second & dirtyBits;
+			if (dirty) {
+				f.write(reinterpret_cast<const char *>(&level), sizeof(level));
+				f.write(reinterpret_cast<const char *>(&tile.first), sizeof(tile.first));
+				f.write(reinterpret_cast<const char *>(&dirty), sizeof(dirty));
+			}
+		}
+	}
+
+	if (!f) {
+		std::cerr << "Couldn't save the changed tiles of world " << w.getWorldName() << std::endl;
+		return false;
+	}
+
+	marksChanged = false;
+	return true;
+}
+
+std::string TilePyramid::getTilePath(u32 level, i32 x, i32 y) const {
+	return dir + "/" + std::to_string(level) + "." + std::to_string(x) + "." + std::to_string(y) + ".png";
+}
+
+// looks up every chunk in the tile only if it was never built or changed
+bool TilePyramid::isAreaEmpty(u32 level, i32 x, i32 y) const {
+	if (tiles[level - 1].find(tileKey(x, y)) != tiles[level - 1].end()) {
+		return false;
+	}
+
+	i32 n = 1 << level;
+	for (i32 cy = y * n; cy < y * n + n; cy++) {
+		for (i32 cx = x * n; cx < x * n + n; cx++) {
+			if (w.isChunkOnDisk(cx, cy) != C_NONE) {
+				return false;
+			}
+		}
+	}
+
+	return true;
+}
+
+// the tile file is reused if it exists, and there are no changes
+void TilePyramid::build(u32 level, i32 x, i32 y, std::function<void(TileRef)> cb) {
+	u64 k = tileKey(x, y);
+	auto search = building[level - 1].find(k);
+	if (search != building[level - 1].end()) {
+		search->second.emplace_back(std::move(cb));
+		return;
+	}
+
+	building[level - 1][k].emplace_back(std::move(cb));
+	buildCount++;
+
+	auto job(std::make_shared<Build>());
+	job->level = level;
+	job->x = x;
+	job->y = y;
+	job->failed = false;
+	job->bg = w.getBackgroundColor();
+	job->path = getTilePath(level, x, y);
+
+	u8& state = tiles[level - 1][k];
+	job->reuseOld = state & onDiskBit;
+	job->dirty = job->reuseOld ? state & dirtyBits : dirtyBits;
+	if (state & dirtyBits) {
+		// changes from now on will be in the next build
+		state &= ~dirtyBits;
+		marksChanged = true;
+	}
+
+	job->pending = 1; // released after requesting all the quadrants
+	for (u32 q = 0; q < 4; q++) {
+		if (job->dirty & (1 << q)) {
+			job->pending++;
+			getQuadrant(level - 1, x * 2 + (q & 1), y * 2 + (q >> 1), [this, job, q] (TileRef t) {
+				job->quadrants[q] = std::move(t);
+				quadrantDone(job);
+			});
+		}
+	}
+
+	quadrantDone(std::move(job));
+}
+
+// level 0 are the chunks
+void TilePyramid::getQuadrant(u32 level, i32 x, i32 y, std::function<void(TileRef)> cb) {
+	if (level != 0) {
+		getTile(level, x, y, std::move(cb));
+		return;
+	}
+
+	if (w.isChunkOnDisk(x, y) == C_NONE && !w.getLoadedChunk(x, y)) {
+		cb(nullptr);
+		return;
+	}
+
+	// the pixels are copied here, the chunk can keep changing while it's downscaled
+	w.loadChunk(x, y, [this, cb{std::move(cb)}] (Chunk * chunk) {
+		if (!chunk) {
+			// unreadable, drawn as empty until it changes
+			cb(nullptr);
+			return;
+		}
+
+		auto rgb(std::make_shared<std::vector<u8>>(chunk->getRgb()));
+		tb.queue([rgb{std::move(rgb)}, cb] (TaskBuffer& tb) {
+			auto tile(std::make_shared<Tile>());
+			const u8 * px = rgb->data();
+			halve(tile->half, [px] (u32 x, u32 y) {
+				const u8 * p = px + (y * Chunk::size + x) * 3;
+				RGB_u clr;
+				clr.rgb = 0;
+				clr.r = p[0];
+				clr.g = p[1];
+				clr.b = p[2];
+				return clr;
+			});
+
+			tb.runInMainThread([cb, tile{std::move(tile)}] (TaskBuffer&) {
+				cb(tile);
+			});
+		});
+	});
+}
+
+void TilePyramid::quadrantDone(std::shared_ptr<Build> job) {
+	if (--job->pending != 0) {
+		return;
+	}
+
+	tb.queue([this, job{std::move(job)}] (TaskBuffer& tb) {
+		TileRef tile;
+		try {
+			tile = compose(*job);
+		} catch (const std::exception& e) {
+			std::cerr << "Couldn't build tile " << job->path << ": " << e.what() << std::endl;
+			job->failed = true;
+		}
+
+		tb.runInMainThread([this, job, tile{std::move(tile)}] (TaskBuffer&) {
+			tileBuilt(*job, tile);
+		});
+	});
+}
+
+void TilePyramid::tileBuilt(const Build& job, TileRef tile) {
+	u64 k = tileKey(job.x, job.y);
+	u8& state = tiles[job.level - 1][k];
+	if (job.failed) {
+		// build it all again next time
+		state = dirtyBits;
+	} else {
+		state |= onDiskBit;
+	}
+
+	if (state & dirtyBits) {
+		// changed while building, the levels above could have used this build
+		markAbove(job.level, job.x, job.y);
+	}
+
+	marksChanged = true;
+
+	auto search = building[job.level - 1].find(k);
+	std::vector<std::function<void(TileRef)>> waiting(std::move(search->second));
+	building[job.level - 1].erase(search);
+	buildCount--;
+
+	for (auto& f : waiting) {
+		f(tile);
+	}
+
+	if (!isBusy() && onIdle) {
+		onIdle();
+	}
+}
+
+void TilePyramid::markAbove(u32 level, i32 x, i32 y) {
+	for (u32 l = level + 1; l <= maxLevel; l++) {
+		u8 q = 1 << ((x & 1) | (y & 1) << 1);
+		x >>= 1;
+		y >>= 1;
+
+		u8& state = tiles[l - 1][tileKey(x, y)];
+		if (!(state & q)) {
+			state |= q;
+			marksChanged = true;
+		}
+	}
+}
+
+// runs in a worker, makes the tile from the old one and the new quadrants
+TilePyramid::TileRef TilePyramid::compose(Build& job) {
+	auto tile(std::make_shared<Tile>());
+	PngImage img;
+	std::vector<u8> old;
+
+	if (job.reuseOld) {
+		old = readTileFile(job.path);
+		try {
+			if (!old.empty()) {
+				img.readFileOnMem(old.data(), old.size());
+			}
+		} catch (const std::exception& e) {
+			std::cerr << "Tile corrupted: " << job.path << ", " << e.what() << std::endl;
+			old.clear();
+		}
+
+		// the quadrants that didn't change are lost
+		job.failed = old.empty() && job.dirty != dirtyBits;
+	}
+
+	if (old.empty()) {
+		img.allocate(Chunk::size, Chunk::size, job.bg);
+	}
+
+	for (u32 q = 0; q < 4; q++) {
+		if (!(job.dirty & (1 << q))) {
+			continue;
+		}
+
+		u32 ox = (q & 1) * halfSize;
+		u32 oy = (q >> 1) * halfSize;
+		const Tile * src = job.quadrants[q].get();
+		for (u32 y = 0; y < halfSize; y++) {
+			for (u32 x = 0; x < halfSize; x++) {
+				RGB_u clr = job.bg;
+				if (src) {
+					const u8 * px = &src->half[(y * halfSize + x) * 3];
+					clr.r = px[0];
+					clr.g = px[1];
+					clr.b = px[2];
+				}
+
+				img.setPixel(ox + x, oy + y, clr);
+			}
+		}
+	}
+
+	if (job.dirty == 0 && !old.empty()) {
+		tile->png = std::move(old);
+	} else {
+		img.writeFileOnMem(tile->png);
+		if (!job.failed && !writeTileFile(job.path, tile->png)) {
+			std::cerr << "Couldn't write tile: " << job.path << std::endl;
+			job.failed = true;
+		}
+	}
+
+	if (job.level < maxLevel) {
+		halve(tile->half, [&img] (u32 x, u32 y) {
+			return img.getPixel(x, y);
+		});
+	}
+
+	tile->etag = "\"" + n2hexstr(u32(crc32(crc32(0, nullptr, 0), tile->png.data(), tile->png.size()))) + "\"";
+	return tile;
+}
+
+// finds the tiles on disk, and the quadrants that changed since they were built
+void TilePyramid::loadMarks() {
+	glob_t result; // XXX: careful with exceptions here
+	std::string pattern(dir + "/*.png");
+	if (int err = glob(pattern.c_str(), GLOB_NOSORT, nullptr, &result)) {
+		if (err != GLOB_NOMATCH) {
+			std::cerr << "glob() error: " << err << std::endl;
+		}
+	} else {
+		for (sz_t i = 0; i < result.gl_pathc; i++) {
+			char * c = result.gl_pathv[i] + dir.size() + 1;
+			u32 level = std::strtoul(c, &c, 10);
+			i32 x = std::strtol(c + 1, &c, 10);
+			i32 y = std::strtol(c + 1, &c, 10);
+			if (level >= 1 && level <= maxLevel) {
+				tiles[level - 1][tileKey(x, y)] |= onDiskBit;
+			}
+		}
+
+		globfree(&result);
+	}
+
+	std::ifstream f(dir + "/dirty.bin", std::ios::binary);
+	u8 level;
+	u64 k;
+	u8 dirty;
+	while (f.read(reinterpret_cast<char *>(&level), sizeof(level))
+			&& f.read(reinterpret_cast<char *>(&k), sizeof(k))
+			&& f.read(reinterpret_cast<char *>(&dirty), sizeof(dirty))) {
+		if (level >= 1 && level <= maxLevel) {
+			tiles[level - 1][k] |= dirty & dirtyBits;
+		}
+	}
+}
@@ -0,0 +1,80 @@
+#pragma once
+
+#include <array>
+#include <vector>
+#include <memory>
+#include <optional>
+#include <string>
+#include <functional>
+#include <unordered_map>
+
+#include <explints.hpp>
+#include <color.hpp>
+
+class TaskBuffer;
+class World;
+
+// Downscaled views of a world, for zoomed out clients. A tile has the size
+// of a chunk, and a tile of level n covers 2^n by 2^n chunks. Tiles are made
+// from the four quadrants below them, down to the chunks, and only the
+// quadrants that changed since the last build are downscaled again.
+class TilePyramid {
+public:
+	static constexpr u32 maxLevel = 4; // 16x
+
+	struct Tile {
+		std::vector<u8> half; // rgb, downscaled by 2 more, for the level above
+		std::vector<u8> png; // empty for chunks
+		std::string etag;
+	};
+
+	using TileRef = std::shared_ptr<const Tile>;
+
+private:
+	struct Build;
+
+	// bits 0-3: quadrants that changed since the tile was built
+	static constexpr u8 dirtyBits = 0xF;
+	static constexpr u8 onDiskBit = 0x10;
+
+	World& w;
+	TaskBuffer& tb;
+	const std::string dir;
+	std::function<void()> onIdle;
+	// state of every tile that was built or has changes, per level
+	std::array<std::unordered_map<u64, u8>, maxLevel> tiles;
+	std::array<std::unordered_map<u64, std::vector<std::function<void(TileRef)>>>, maxLevel> building;
+	sz_t buildCount;
+	bool marksChanged;
+
+public:
+	TilePyramid(World&, TaskBuffer&, std::string worldDir);
+
+	// onIdle is called when the last build finishes
+	void setIdleFunc(std::function<void()>);
+
+	void chunkChanged(i32 chunkX, i32 chunkY);
+
+	// tile is nullptr if there's nothing drawn there
+	void getTile(u32 level, i32 x, i32 y, std::function<void(TileRef)>);
+	// the file of a tile that has no changes and isn't being built, it can
+	// be sent as is. call tileFileMissing if it doesn't exist
+	std::optional<std::string> getStoredTilePath(u32 level, i32 x, i32 y) const;
+	void tileFileMissing(u32 level, i32 x, i32 y);
+
+	bool isBusy() const;
+	bool save();
+
+private:
+	std::string getTilePath(u32 level, i32 x, i32 y) const;
+	bool isAreaEmpty(u32 level, i32 x, i32 y) const;
+
+	void build(u32 level, i32 x, i32 y, std::function<void(TileRef)>);
+	void getQuadrant(u32 level, i32 x, i32 y, std::function<void(TileRef)>);
+	void quadrantDone(std::shared_ptr<Build>);
+	void tileBuilt(const Build&, TileRef);
+	void markAbove(u32 level, i32 x, i32 y);
+	static TileRef compose(Build&);
+
+	void loadMarks();
+};
@@ -6,14 +6,24 @@
 #include <config.hpp>
 #include <PacketDefinitions.hpp>
 #include <ApiProcessor.hpp>
+#include <HttpData.hpp>
 
 #include <TaskBuffer.hpp>
+#include <ChunkCache.hpp>
+#include <SaveProgress.hpp>
 #include <utils.hpp>
 
 #include <iostream>
 #include <utility>
 #include <algorithm>
-#include <fstream>
+#include <cstring>
+#include <cerrno>
+#include <ctime>
+#include <exception>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include <uWS.h>
 #include <nlohmann/json.hpp>
@@ -40,22 +50,86 @@ u64 key(i32 x, i32 y) {
 	return s.pos;
 }
 
+// opcode, left count, lefts, cursor count, cursors, pixel count, pixels
+static constexpr sz_t maxUpdateSize = sizeof(u8)
+	+ sizeof(u8) + WORLD_MAX_PLAYER_LEFT_UPDATES * sizeof(Player::Id)
+	+ sizeof(u8) + WORLD_MAX_PLAYER_UPDATES * (sizeof(Player::Id) + sizeof(World::Pos) * 2 + sizeof(Player::Step) + sizeof(Player::Tid))
+	+ sizeof(u16) + WORLD_MAX_PIXEL_UPDATES * sizeof(pixupd_t);
+
+static_assert(WORLD_MAX_PLAYER_LEFT_UPDATES <= 255 && WORLD_MAX_PLAYER_UPDATES <= 255
+	&& WORLD_MAX_PIXEL_UPDATES <= 65535, "World update limits don't fit in the packet counters");
+
+template<typename T>
+static u8 * put(u8 * buf, T value) {
+	std::memcpy(buf, &value, sizeof(T));
+	return buf + sizeof(T);
+}
+
+// erases the first n elements, returns true if some are left for the next tick
+template<typename T>
+static bool dropSent(std::vector<T>& v, sz_t n) {
+	v.erase(v.begin(), v.begin() + n);
+	return v.size() != 0;
+}
+
 void to_json(nlohmann::json& j, const World& w) {
 	auto owner(w.getOwner());
 	j = {
 		{ "owner", owner ? nlohmann::json{} : nlohmann::json{n2hexstr(*owner)} },
 		{ "motd", std::string(w.getMotd()) },
-		{ "playersOnline", w.getPlayerCount() }
+		{ "playersOnline", w.getPlayerCount() },
+		{ "chunksLoading", w.getLoadingChunkCount() },
+		{ "avgChunkLoadTimeUs", w.getAverageChunkLoadTime().count() },
+		{ "pixelLogFailing", w.getPixelLog().isFailing() }
 	};
 }
 
 /* World class functions */
 
-World::World(std::tuple<std::string, std::string> wsArgs, TaskBuffer& tb)
+World::World(std::tuple<std::string, std::string> wsArgs, TaskBuffer& tb, ChunkCache& cache, SaveProgress& saves)
 : WorldStorage(std::move(wsArgs)),
   tb(tb),
+  cache(cache),
+  saves(saves),
+  pyramid(*this, tb, getWorldDir()),
+  pendingSaves(0),
+  savedLogSegment(0),
+  saveFailed(false),
+  saveCoversLog(false),
   updateRequired(false),
-  drawRestricted(false) { }
+  drawRestricted(false),
+  averageChunkLoadTime(0),
+  updateBuf(std::make_unique<u8[]>(maxUpdateSize)) {
+	pyramid.setIdleFunc([this] {
+		tryUnloadWorld();
+	});
+
+	setSettingsChangedFunc([this] {
+		settingsChanged();
+	});
+
+	// pixels replayed from the log changed these chunks, the marks are
+	// written before the log is gone
+	if (!getReplayedChunks().empty()) {
+		for (u64 k : getReplayedChunks()) {
+			twoi32 pos;
+			pos.pos = k;
+			pyramid.chunkChanged(pos.x, pos.y);
+		}
+
+		pyramid.save();
+	}
+
+	replayedChunksMarked();
+
+	// chunks that failed to replay get their pixels once loaded, then
+	// the next save writes them and the log can be discarded again
+	for (const auto& c : getUnreplayedPixels()) {
+		twoi32 pos;
+		pos.pos = c.first;
+		loadChunk(pos.x, pos.y, [] (Chunk *) { });
+	}
+}
 
 World::~World() {
 	std::cout << "World unloaded: " << getWorldName() << std::endl;
@@ -71,7 +145,8 @@ sz_t World::unloadOldChunks(bool force) { // TODO: handle force flag better
 	//auto oldest = chunks.end();
 
 	for (auto it = chunks.begin(); it != chunks.end();) {
-		if (it->second.shouldUnload(force)) {
+		// dirty chunks are written by the next save, not here
+		if (it->second.shouldUnload(force) && !it->second.isDirty()) {
 			/*if (force && (oldest == chunks.end() || it->second.getLastActionTime() < oldest->second.getLastActionTime())) {
 				oldest = it;
 			} else {*/
@@ -91,6 +166,69 @@ sz_t World::unloadOldChunks(bool force) { // TODO: handle force flag better
 	return unloadCount;
 }
 
+// returns the memory used by every loaded chunk of this world
+u64 World::listEvictableChunks(std::vector<EvictableChunk>& list) {
+	u64 used = 0;
+	for (auto& chunk : chunks) {
+		const Chunk& c = chunk.second;
+		if (!c.isLoaded()) {
+			continue;
+		}
+
+		used += c.getMemoryUsage();
+		// dirty chunks stay until the next save
+		if (c.shouldUnload(true) && !c.isDirty()) {
+			list.push_back({c.getLastActionTime(), this, chunk.first});
+		}
+	}
+
+	return used;
+}
+
+// returns the amount of chunk bytes freed, the png it had is counted
+// again on the next listPngCaches
+sz_t World::evictChunk(u64 k) {
+	auto search = chunks.find(k);
+	if (search == chunks.end() || !search->second.shouldUnload(true)) {
+		return 0;
+	}
+
+	sz_t freed = search->second.getMemoryUsage();
+	chunks.erase(search);
+	cache.evicted();
+	return freed;
+}
+
+// returns the memory used by the pngs of this world
+u64 World::listPngCaches(std::vector<EvictableChunk>& list) {
+	u64 used = 0;
+	for (auto& chunk : chunks) {
+		const Chunk& c = chunk.second;
+		if (sz_t size = c.getPngMemoryUsage()) {
+			used += size;
+			list.push_back({c.getLastActionTime(), this, chunk.first});
+		}
+	}
+
+	return used;
+}
+
+// returns the amount of bytes freed
+sz_t World::dropPngCache(u64 k) {
+	auto search = chunks.find(k);
+	// can't drop it while it's being encoded
+	if (search == chunks.end() || ongoingChunkRequests.count(k)) {
+		return 0;
+	}
+
+	sz_t freed = search->second.dropPngCache();
+	if (freed) {
+		cache.pngDropped();
+	}
+
+	return freed;
+}
+
 void World::configurePlayerBuilder(Player::Builder& pb) {
 	pb.setWorld(*this)
 	  .setSpawnPoint(0, 0)
@@ -114,18 +252,33 @@ void World::playerJoined(Player& pl) {
 	WorldData::one(pl.getClient().getWs(), worldName, std::string(getMotd()), getBackgroundColor().rgb, drawRestricted, getOwner());
 }
 
+// resends the world data and paint rate to everyone
+void World::settingsChanged() {
+	broadcast(WorldData(worldName, std::string(getMotd()), getBackgroundColor().rgb, drawRestricted, getOwner()));
+	for (Player& pl : players) {
+		pl.setPaintRate(getPixelRate(), 3);
+	}
+}
+
+// players are queued once, and sent in order, so none of them waits
+// more than a few ticks when there are more than WORLD_MAX_PLAYER_UPDATES
 void World::playerUpdated(Player& pl) {
-	playerUpdates.emplace(std::ref(pl));
+	if (!pl.isUpdateQueued()) {
+		pl.setUpdateQueued(true);
+		playerUpdates.emplace_back(std::ref(pl));
+	}
+
 	schedUpdates();
 }
 
 void World::playerLeft(Player& pl) {
-	// XXX: a client could immediately join with the same pid
-	// solution: move player lefts at the beginning of the network update packet
-	playersLeft.emplace(pl.getPid());
+	// a client could immediately join with the same pid, that's why
+	// player lefts are at the beginning of the world update packet
+	playersLeft.emplace_back(pl.getPid());
 	ids.freeId(pl.getPid());
 	players.erase(std::ref(pl));
-	playerUpdates.erase(std::ref(pl));
+	playerUpdates.erase(std::remove(playerUpdates.begin(), playerUpdates.end(), std::ref(pl)), playerUpdates.end());
+	playerAreas.erase(pl.getPid());
 	schedUpdates();
 	if (players.size() == 0) {
 		tryUnloadWorld();
@@ -143,89 +296,116 @@ void World::sendUpdates() {
 
 	updateRequired = false;
 
-	/*sz_t offs = 2;
-	u32 tmp;
+	if (players.size() == 0) {
+		playersLeft.clear();
+		playerUpdates.clear();
+		pixelUpdates.clear();
+		areas.clear();
+		return;
+	}
 
-	u8 buf[1 + 1 + playerUpdates.size() * (sizeof(u32) + sizeof(pinfo_t))
-		+ sizeof(u16) + pixelUpdates.size() * sizeof(pixupd_t)
-		+ 1 + sizeof(u32) * playersLeft.size()];
-	u8 * const upd = &buf[0];
+	bool pendingUpdates = false;
 
-	upd[0] = UPDATE;
+	// whatever doesn't fit in the WORLD_MAX_* limits is sent next tick
+	const sz_t leftCount = std::min<sz_t>(playersLeft.size(), WORLD_MAX_PLAYER_LEFT_UPDATES);
+	const sz_t cursorCount = std::min<sz_t>(playerUpdates.size(), WORLD_MAX_PLAYER_UPDATES);
+	const sz_t pixelCount = std::min<sz_t>(pixelUpdates.size(), WORLD_MAX_PIXEL_UPDATES);
 
-	bool pendingUpdates = false;
+	for (u32 i = 0; i < cursorCount; i++) {
+		const Player& pl = playerUpdates[i];
+		u64 k = areaKey(pl.getX(), pl.getY());
+		areas[k].cursors.emplace_back(i);
 
-	tmp = 0;
-	for (auto it = playerUpdates.begin();;) {
-		if (it == playerUpdates.end()) {
-			playerUpdates.clear();
-			break;
-		}
-		if(tmp >= WORLD_MAX_PLAYER_UPDATES){
-			playerUpdates.erase(playerUpdates.begin(), it);
-			pendingUpdates = true;
-			break;
+		auto last = playerAreas.find(pl.getPid());
+		if (last != playerAreas.end() && last->second != k) {
+			// so the viewers of the old area see it leave
+			areas[last->second].cursors.emplace_back(i);
 		}
-		Player& pl = *it;
-		u32 id = pl.getPid();
-		i32 x = pl.getX();
-		i32 y = pl.getY();
-		memcpy((void *)(upd + offs), (void *)&id, sizeof(u32));
-		offs += sizeof(u32);
-		memcpy((void *)(upd + offs), (void *)&x, sizeof(i32));
-		offs += sizeof(i32);
-		memcpy((void *)(upd + offs), (void *)&y, sizeof(i32));
-		offs += sizeof(i32);
-		++it;
-		++tmp;
-	}
-	upd[1] = tmp;
-	tmp = pixelUpdates.size();
-	tmp = tmp >= WORLD_MAX_PIXEL_UPDATES ? WORLD_MAX_PIXEL_UPDATES : tmp;
-	memcpy((void *)(upd + offs), &tmp, sizeof(u16));
-	tmp = 0;
-	offs += sizeof(u16);
-	for(auto& px : pixelUpdates){
-		memcpy((void *)(upd + offs), &px, sizeof(pixupd_t));
-		offs += sizeof(pixupd_t);
-		if(++tmp >= WORLD_MAX_PIXEL_UPDATES){
-			break;
+	}
+
+	for (u32 i = 0; i < pixelCount; i++) {
+		areas[areaKey(pixelUpdates[i].x, pixelUpdates[i].y)].pixels.emplace_back(i);
+	}
+
+	enteredAreas.clear();
+	for (Player& pl : players) {
+		u64 k = areaKey(pl.getX(), pl.getY());
+		auto last = playerAreas.find(pl.getPid());
+		if (last == playerAreas.end()) {
+			playerAreas.emplace(pl.getPid(), k);
+			enteredAreas.emplace_back(k);
+		} else if (last->second != k) {
+			last->second = k;
+			enteredAreas.emplace_back(k);
 		}
+
+		areas[k].viewers.emplace_back(std::ref(pl));
 	}
-	pixelUpdates.clear();
 
-	tmp = playersLeft.size();
-	tmp = tmp >= WORLD_MAX_PLAYER_LEFT_UPDATES ? WORLD_MAX_PLAYER_LEFT_UPDATES : tmp;
-	memcpy((void *)(upd + offs), &tmp, sizeof(u8));
-	tmp = 0;
-	offs += sizeof(u8);
-	for (auto it = playersLeft.begin();;) {
-		if (it == playersLeft.end()) {
-			playersLeft.clear();
-			break;
+	for (auto& area : areas) {
+		if (area.second.viewers.size() == 0) {
+			continue;
 		}
-		if(tmp >= WORLD_MAX_PLAYER_LEFT_UPDATES){
-			playersLeft.erase(playersLeft.begin(), it);
-			pendingUpdates = true;
-			break;
+
+		twoi32 pos;
+		pos.pos = area.first;
+		areaCursors.clear();
+		areaPixels.clear();
+		forEachAreaAround(pos.x, pos.y, [this] (InterestArea& near) {
+			areaCursors.insert(areaCursors.end(), near.cursors.begin(), near.cursors.end());
+			areaPixels.insert(areaPixels.end(), near.pixels.begin(), near.pixels.end());
+		});
+
+		if (leftCount == 0 && areaCursors.size() == 0 && areaPixels.size() == 0) {
+			continue;
 		}
-		u32 pl = *it;
-		memcpy((void *)(upd + offs), &pl, sizeof(u32));
-		offs += sizeof(u32);
-		++tmp;
-		++it;
+
+		// a cursor can be in two areas if it moved, and pixels must keep their paint order
+		std::sort(areaCursors.begin(), areaCursors.end());
+		areaCursors.erase(std::unique(areaCursors.begin(), areaCursors.end()), areaCursors.end());
+		std::sort(areaPixels.begin(), areaPixels.end());
+
+		sendAreaUpdate(area.second.viewers, leftCount);
 	}
 
-	uWS::WebSocket<uWS::SERVER>::PreparedMessage * prep = uWS::WebSocket<uWS::SERVER>::prepareMessage(
-		(char *)upd, offs, uWS::BINARY, false);
-	for (Player& pl : players) {
-		pl.getClient().getWs()->sendPrepared(prep);
+	// the sent cursors are dropped below, they can be queued again after this
+	for (sz_t i = 0; i < cursorCount; i++) {
+		playerUpdates[i].get().setUpdateQueued(false);
+	}
+
+	// players that entered a new area need to know about the cursors already there
+	for (u64 k : enteredAreas) {
+		twoi32 pos;
+		pos.pos = k;
+		forEachAreaAround(pos.x, pos.y, [this] (InterestArea& near) {
+			for (Player& pl : near.viewers) {
+				playerUpdated(pl);
+			}
+		});
 	}
-	uWS::WebSocket<uWS::SERVER>::finalizeMessage(prep);
+
+	for (auto it = areas.begin(); it != areas.end();) {
+		InterestArea& a = it->second;
+		if (a.viewers.size() != 0 || a.cursors.size() != 0 || a.pixels.size() != 0) {
+			a.viewers.clear();
+			a.cursors.clear();
+			a.pixels.clear();
+			a.idleUpdates = 0;
+			++it;
+		} else if (++a.idleUpdates > WORLD_INTEREST_AREA_IDLE_UPDATES) {
+			it = areas.erase(it);
+		} else {
+			++it;
+		}
+	}
+
+	pendingUpdates |= dropSent(playersLeft, leftCount);
+	pendingUpdates |= dropSent(playerUpdates, cursorCount);
+	pendingUpdates |= dropSent(pixelUpdates, pixelCount);
 
 	if (pendingUpdates) {
 		schedUpdates();
-	}*/
+	}
 }
 
 bool World::verifyChunkPos(Chunk::Pos x, Chunk::Pos y) {
@@ -233,23 +413,159 @@ bool World::verifyChunkPos(Chunk::Pos x, Chunk::Pos y) {
 		&& x >= ~border && y >= ~border;
 }
 
-Chunk& World::getChunk(Chunk::Pos x, Chunk::Pos y) {
+// returns nullptr if the chunk is not loaded, or still loading. not counted
+// in the cache stats, paints and tile builds would drown the real lookups
+Chunk * World::getLoadedChunk(Chunk::Pos x, Chunk::Pos y) {
 	auto search = chunks.find(key(x, y));
-	if (search == chunks.end()) {
-		WorldStorage::maybeConvertChunk(x, y);
+	if (search == chunks.end() || !search->second.isLoaded()) {
+		return nullptr;
+	}
 
-		search = chunks.emplace(std::piecewise_construct,
-			std::forward_as_tuple(key(x, y)),
-			std::forward_as_tuple(x, y, *this)).first;
+	return &search->second;
+}
 
-		if (chunks.size() > 64) {
-			search->second.preventUnloading(true);
-			unloadOldChunks(true);
-			search->second.preventUnloading(false);
+// calls onLoad right away if the chunk is loaded, or once it is read from disk.
+// onLoad gets nullptr if the chunk couldn't be read
+void World::loadChunk(Chunk::Pos x, Chunk::Pos y, std::function<void(Chunk *)> onLoad) {
+	u64 k = key(x, y);
+	auto search = chunks.find(k);
+	if (search != chunks.end()) {
+		cache.hit();
+		if (search->second.isLoaded()) {
+			onLoad(&search->second);
+		} else {
+			loadingChunks.at(k).emplace_back(std::move(onLoad));
 		}
+
+		return;
 	}
 
-	return search->second;
+	cache.miss();
+	WorldStorage::maybeConvertChunk(x, y);
+
+	search = chunks.emplace(std::piecewise_construct,
+		std::forward_as_tuple(k),
+		std::forward_as_tuple(x, y, *this)).first;
+
+	Chunk& chunk = search->second;
+	// can't be unloaded until the pending actions are done
+	chunk.preventUnloading(true);
+	loadingChunks[k].emplace_back(std::move(onLoad));
+
+	auto start(std::chrono::steady_clock::now());
+	tb.queue([this, &chunk, k, start, bg{getBackgroundColor()}] (TaskBuffer& tb) {
+		std::optional<std::string> err;
+		try {
+			chunk.load(bg);
+		} catch (const std::exception& e) {
+			err = e.what();
+		} catch (...) {
+			err = "unknown error";
+		}
+
+		tb.runInMainThread([this, &chunk, k, start, err{std::move(err)}] (TaskBuffer&) {
+			if (err) {
+				chunkLoadFailed(k, *err);
+			} else {
+				chunkLoaded(chunk, k, start);
+			}
+		});
+	});
+}
+
+void World::chunkLoaded(Chunk& chunk, u64 k, std::chrono::steady_clock::time_point start) {
+	FloatMicros loadTime(std::chrono::steady_clock::now() - start);
+	averageChunkLoadTime = (loadTime + averageChunkLoadTime) / 2.f;
+
+	auto search = loadingChunks.find(k);
+	std::vector<std::function<void(Chunk *)>> pending(std::move(search->second));
+	loadingChunks.erase(search);
+
+	RGB_u bg = getBackgroundColor();
+	for (const auto& p : takeUnreplayedPixels(k)) {
+		RGB_u clr = bg;
+		clr.r = p.r;
+		clr.g = p.g;
+		clr.b = p.b;
+		chunk.setPixel(p.x, p.y, clr);
+	}
+
+	for (auto& f : pending) {
+		f(&chunk);
+	}
+
+	chunk.preventUnloading(false);
+	tryUnloadWorld();
+}
+
+// the chunk is forgotten, so the next request tries to read it again
+void World::chunkLoadFailed(u64 k, const std::string& error) {
+	twoi32 pos;
+	pos.pos = k;
+	std::cerr << "Error while loading chunk " << pos.x << ", " << pos.y
+		<< " of world " << getWorldName() << ": " << error << std::endl;
+
+	auto search = loadingChunks.find(k);
+	std::vector<std::function<void(Chunk *)>> pending(std::move(search->second));
+	loadingChunks.erase(search);
+	chunks.erase(k); // not loaded, won't write anything
+
+	for (auto& f : pending) {
+		f(nullptr);
+	}
+
+	tryUnloadWorld();
+}
+
+u64 World::areaKey(World::Pos x, World::Pos y) {
+	return key(x >> areaShift, y >> areaShift);
+}
+
+template<typename Fn>
+void World::forEachAreaAround(i32 ax, i32 ay, Fn f) {
+	for (i32 y = ay - WORLD_INTEREST_AREA_RADIUS; y <= ay + WORLD_INTEREST_AREA_RADIUS; y++) {
+		for (i32 x = ax - WORLD_INTEREST_AREA_RADIUS; x <= ax + WORLD_INTEREST_AREA_RADIUS; x++) {
+			auto search = areas.find(key(x, y));
+			if (search != areas.end()) {
+				f(search->second);
+			}
+		}
+	}
+}
+
+// encodes the lefts, and the cursors and pixels in areaCursors and areaPixels
+void World::sendAreaUpdate(const std::vector<std::reference_wrapper<Player>>& viewers, sz_t leftCount) {
+	u8 * const upd = updateBuf.get();
+	u8 * p = put<u8>(upd, net::tc::WORLD_UPDATE);
+
+	p = put<u8>(p, leftCount);
+	for (sz_t i = 0; i < leftCount; i++) {
+		p = put<Player::Id>(p, playersLeft[i]);
+	}
+
+	p = put<u8>(p, areaCursors.size());
+	for (u32 i : areaCursors) {
+		const Player& pl = playerUpdates[i];
+		p = put<Player::Id>(p, pl.getPid());
+		p = put<World::Pos>(p, pl.getX());
+		p = put<World::Pos>(p, pl.getY());
+		p = put<Player::Step>(p, pl.getStep());
+		p = put<Player::Tid>(p, pl.getToolId());
+	}
+
+	p = put<u16>(p, areaPixels.size());
+	for (u32 i : areaPixels) {
+		p = put<pixupd_t>(p, pixelUpdates[i]);
+	}
+
+	auto * prep = uWS::WebSocket<uWS::SERVER>::prepareMessage(
+		reinterpret_cast<char *>(upd), p - upd, uWS::BINARY, false);
+
+	for (Player& pl : viewers) {
+		pl.getClient().getWs()->sendPrepared(prep);
+	}
+
+	uWS::WebSocket<uWS::SERVER>::finalizeMessage(prep);
 }
 
 void World::sendUserUpdate(User& u) {
@@ -260,14 +576,139 @@ void World::sendPlayerCountStats(u32 globalPlayerCount) {
 	broadcast(Stats(getPlayerCount(), globalPlayerCount));
 }
 
-// returns true if this function ended the request before returning
-bool World::sendChunk(Chunk::Pos x, Chunk::Pos y, ll::shared_ptr<Request> req) {
-	if (!verifyChunkPos(x, y)) {
+struct PngFile {
+	bool found = false;
+	bool missing = false; // the file doesn't exist, other errors aren't
+	std::string etag;
+	std::string lastModified;
+	std::string data;
+};
+
+// runs in a worker thread
+static PngFile readPngFile(const std::string& path) {
+	PngFile f;
+	int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		f.missing = errno == ENOENT;
+		if (!f.missing) {
+			std::cerr << "Couldn't open " << path << ": " << std::strerror(errno) << std::endl;
+		}
+
+		return f;
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) == 0) {
+		f.data.resize(st.st_size);
+		sz_t done = 0;
+		while (done < f.data.size()) {
+			ssize_t r = read(fd, &f.data[done], f.data.size() - done);
+			if (r < 0 && errno == EINTR) {
+				continue;
+			} else if (r <= 0) {
+				break;
+			}
+
+			done += r;
+		}
+
+		f.data.resize(done);
+		f.found = done == sz_t(st.st_size);
+		// tiles can be rewritten more than once a second
+		f.etag = "\"" + n2hexstr(u64(st.st_mtim.tv_sec)) + n2hexstr(u32(st.st_mtim.tv_nsec))
+			+ "-" + n2hexstr(u64(st.st_size)) + "\"";
+
+		char date[32];
+		struct tm t;
+		gmtime_r(&st.st_mtime, &t);
+		f.lastModified.assign(date, std::strftime(date, sizeof(date), "%a, %d %b %Y %H:%M:%S GMT", &t));
+	}
+
+	close(fd);
+	return f;
+}
+
+static bool isModified(Request& req, std::string_view etag, std::string_view lastModified) {
+	if (auto etags = req.getData().getHeader("if-none-match")) {
+		return *etags != "*" && etags->find(etag) == std::string_view::npos;
+	}
+
+	if (auto since = req.getData().getHeader("if-modified-since")) {
+		return lastModified.empty() || *since != lastModified;
+	}
+
+	return true;
+}
+
+// ends the request with the png, or with a 304 if the client has this version
+static void endWithPng(Request& req, std::string_view etag, std::string_view lastModified,
+		const char * data, sz_t size) {
+	bool modified = isModified(req, etag, lastModified);
+	req.writeStatus(modified ? "200 OK" : "304 Not Modified");
+	req.writeHeader("ETag", etag);
+	req.writeHeader("Cache-Control", "public, no-cache"); // caches must revalidate
+	if (!lastModified.empty()) {
+		req.writeHeader("Last-Modified", lastModified);
+	}
+
+	if (modified) {
+		req.writeHeader("Content-Type", "image/png");
+		req.end(data, size);
+	} else {
+		req.end();
+	}
+}
+
+static void endWithPng(Request& req, const Chunk& chunk) {
+	const auto& d = chunk.getPngData();
+	endWithPng(req, chunk.getPngEtag(), {}, reinterpret_cast<const char *>(d.data()), d.size());
+}
+
+// returns true if this function ended the request before returning.
+// downscaling must be a power of 2, up to 2^TilePyramid::maxLevel
+bool World::sendChunk(Chunk::Pos x, Chunk::Pos y, u8 downscaling, ll::shared_ptr<Request> req) {
+	if (!verifyChunkPos(x, y) || !verifyChunkPos(x * downscaling, y * downscaling)) {
 		req->writeStatus("400 Bad Request");
 		req->end();
 		return true;
 	}
 
+	if (downscaling != 1) {
+		u32 level = popc(downscaling - 1);
+		// tiles without changes are sent as they are on disk
+		if (auto path = pyramid.getStoredTilePath(level, x, y)) {
+			sendFile(std::move(*path), std::move(req), [this, x, y, level, downscaling] (ll::shared_ptr<Request> req) {
+				pyramid.tileFileMissing(level, x, y);
+				sendChunk(x, y, downscaling, std::move(req));
+			});
+
+			return false;
+		}
+
+		pyramid.getTile(level, x, y, [this, x, y, level, downscaling, req{std::move(req)}] (TilePyramid::TileRef tile) {
+			if (req->isCancelled()) {
+				return;
+			}
+
+			if (!tile) {
+				req->writeStatus("204 No Content");
+				req->end();
+				return;
+			}
+
+			if (pyramid.getStoredTilePath(level, x, y)) {
+				// written, send it from disk so the ETag doesn't change later
+				sendChunk(x, y, downscaling, req);
+				return;
+			}
+
+			const auto& d = tile->png;
+			endWithPng(*req, tile->etag, {}, reinterpret_cast<const char *>(d.data()), d.size());
+		});
+
+		return false;
+	}
+
 	EChunkFormat fmt = isChunkOnDisk(x, y);
 	switch (fmt) {
 		case C_NONE: // if the chunk doesn't exist, don't load it
@@ -275,35 +716,99 @@ bool World::sendChunk(Chunk::Pos x, Chunk::Pos y, ll::shared_ptr<Request> req) {
 			req->end();
 			return true;
 
-		case C_PNG: { // if it's a PNG, just send it whole. TODO: actually stream, instead of wasting memory
-			std::ifstream ch(getChunkFilePath(x, y), std::ios::binary | std::ios::ate);
-			if (!ch) {
-				// ok what
-				break;
+		default:
+			break;
+	}
+
+	Chunk * loaded = getLoadedChunk(x, y);
+	// if it's a PNG, send the file as is, unless it was modified since
+	if (fmt == C_PNG && (!loaded || !loaded->isDirty())) {
+		sendFile(getChunkFilePath(x, y), std::move(req), [this, x, y] (ll::shared_ptr<Request> req) {
+			if (isChunkOnDisk(x, y) == C_PNG) {
+				// the file is gone, and wasn't moved to a region either
+				setChunkOnDisk(x, y, C_NONE);
 			}
 
-			sz_t size = ch.tellg();
-			ch.seekg(0);
-			auto data(std::make_unique<char[]>(size));
-			ch.read(data.get(), size);
-			req->end(data.get(), size);
-			return true;
-		} break;
+			// probably converted while we were reading it
+			sendChunk(x, y, 1, std::move(req));
+		});
 
-		default:
-			break;
+		return false;
+	}
+
+	if (!loaded) {
+		// counts the hit or miss
+		loadChunk(x, y, [this, req{std::move(req)}] (Chunk * chunk) {
+			if (req->isCancelled()) {
+				return;
+			}
+
+			if (!chunk) {
+				req->writeStatus("500 Internal Server Error");
+				req->end();
+				return;
+			}
+
+			sendLoadedChunk(*chunk, req);
+		});
+
+		return false;
 	}
 
-	// will load the chunk if unloaded
-	Chunk& chunk = getChunk(x, y);
+	cache.hit();
+	return sendLoadedChunk(*loaded, std::move(req));
+}
+
+// the file is read in a worker, and shared between all requests for it.
+// onMissing gets the requests if it doesn't exist, on other errors they get a 500
+void World::sendFile(std::string path, ll::shared_ptr<Request> req, std::function<void(ll::shared_ptr<Request>)> onMissing) {
+	auto search = ongoingFileReads.find(path);
+	if (search != ongoingFileReads.end()) {
+		search->second.emplace_back(std::move(req));
+		return;
+	}
+
+	ongoingFileReads[path].emplace_back(std::move(req));
+	tb.queue([this, path{std::move(path)}, onMissing{std::move(onMissing)}] (TaskBuffer& tb) {
+		PngFile f(readPngFile(path));
+		tb.runInMainThread([this, path, onMissing, f{std::move(f)}] (TaskBuffer&) {
+			auto search = ongoingFileReads.find(path);
+			std::vector<ll::shared_ptr<Request>> reqs(std::move(search->second));
+			ongoingFileReads.erase(search);
+
+			for (auto& req : reqs) {
+				if (req->isCancelled()) {
+					continue;
+				}
+
+				if (f.missing) {
+					onMissing(std::move(req));
+					continue;
+				}
+
+				if (!f.found) {
+					req->writeStatus("500 Internal Server Error");
+					req->end();
+					continue;
+				}
+
+				endWithPng(*req, f.etag, f.lastModified, f.data.data(), f.data.size());
+			}
+
+			tryUnloadWorld();
+		});
+	});
+}
+
+bool World::sendLoadedChunk(Chunk& chunk, ll::shared_ptr<Request> req) {
+	chunk.updateLastActionTime();
 
 	if (!chunk.isPngCacheOutdated()) {
-		const auto& d = chunk.getPngData();
-		req->end(reinterpret_cast<const char *>(d.data()), d.size());
+		endWithPng(*req, chunk);
 		return true;
 	}
 
-	u64 k = key(x, y);
+	u64 k = key(chunk.getX(), chunk.getY());
 	auto search = ongoingChunkRequests.find(k);
 	if (search == ongoingChunkRequests.end()) {
 		chunk.preventUnloading(true);
@@ -312,24 +817,45 @@ bool World::sendChunk(Chunk::Pos x, Chunk::Pos y, ll::shared_ptr<Request> req) {
 			std::forward_as_tuple(k),
 			std::forward_as_tuple(std::initializer_list<ll::shared_ptr<Request>>({std::move(req)}))).first;
 
-		auto end = [this, search, &chunk] (TaskBuffer& tb) {
-			const auto& d = chunk.getPngData();
+		// always called, even if the encoding failed
+		auto end = [this, search, &chunk, v{chunk.getVersion()}] (bool ok) {
+			if (ok) {
+				chunk.pngCacheUpdated(v);
+			} else {
+				// the dirty bands went with the snapshot, the next request encodes it all
+				chunk.dropPngCache();
+			}
+
 			for (auto& req : search->second) {
-				if (!req->isCancelled()) { // TODO: Prepared HTTP response?
-					//req->writeHeader("Content-Type", "image/png");
-					req->end(reinterpret_cast<const char *>(d.data()), d.size());
+				if (req->isCancelled()) {
+					continue;
+				}
+
+				if (ok) {
+					endWithPng(*req, chunk);
+				} else {
+					req->writeStatus("500 Internal Server Error");
+					req->end();
 				}
 			}
 
 			ongoingChunkRequests.erase(search);
 			chunk.preventUnloading(false);
-			chunk.unsetCacheOutdatedFlag();
 			tryUnloadWorld();
 		};
 
-		tb.queue([&chunk, end{std::move(end)}] (TaskBuffer& tb) {
-			chunk.updatePngCache();
-			tb.runInMainThread(std::move(end));
+		tb.queue([&chunk, snap{chunk.takePngSnapshot()}, end{std::move(end)}] (TaskBuffer& tb) {
+			bool ok = true;
+			try {
+				chunk.updatePngCache(*snap);
+			} catch (const std::exception& e) {
+				std::cerr << "Couldn't encode chunk " << chunk.getX() << ", " << chunk.getY() << ": " << e.what() << std::endl;
+				ok = false;
+			}
+
+			tb.runInMainThread([end{std::move(end)}, ok] (TaskBuffer&) {
+				end(ok);
+			});
 		});
 	} else {
 		// add this request to the list, if a png is already being encoded
@@ -352,20 +878,36 @@ void World::chat(Player& p, const std::string& s) {
 	broadcast(ChatMessage(p.getUser().getId(), s));
 }
 
-// returns false when you were not allowed to paint, or position is out of range
-bool World::paint(Player& p, World::Pos x, World::Pos y, RGB_u clr) {
+// paints on chunks that are still loading are checked once they load,
+// the player could be gone by then
+World::PaintResult World::paint(Player& p, World::Pos x, World::Pos y, RGB_u clr) {
 	Chunk::Pos cx = x >> Chunk::posShift;
 	Chunk::Pos cy = y >> Chunk::posShift;
 
 	if (!verifyChunkPos(cx, cy)) {
-		return false;
+		return PaintResult::DENIED;
+	}
+
+	if (Chunk * chunk = getLoadedChunk(cx, cy)) {
+		return applyPaint(*chunk, p.getPid(), x, y, clr) ? PaintResult::APPLIED : PaintResult::DENIED;
 	}
 
-	Chunk& chunk = getChunk(cx, cy);
+	// dropped if the chunk fails to load
+	loadChunk(cx, cy, [this, pid{p.getPid()}, x, y, clr] (Chunk * chunk) {
+		if (chunk) {
+			applyPaint(*chunk, pid, x, y, clr);
+		}
+	});
+
+	return PaintResult::QUEUED;
+}
 
-	if (isActionPaintAllowed(chunk, x, y, p)) {
+bool World::applyPaint(Chunk& chunk, Player::Id pid, World::Pos x, World::Pos y, RGB_u clr) {
+	if (isActionPaintAllowed(chunk, x, y, pid)) {
 		if (chunk.setPixel(x, y, clr)) {
-			pixelUpdates.push_back({p.getPid(), x, y, clr.r, clr.g, clr.b});
+			pixelUpdates.push_back({pid, x, y, clr.r, clr.g, clr.b});
+			getPixelLog().append(pixelUpdates.back());
+			pyramid.chunkChanged(x >> Chunk::posShift, y >> Chunk::posShift);
 			schedUpdates();
 		}
 
@@ -376,15 +918,20 @@ bool World::paint(Player& p, World::Pos x, World::Pos y, RGB_u clr) {
 }
 
 void World::setAreaProtection(Chunk::ProtPos x, Chunk::ProtPos y, bool state) {
-	Chunk& chunk = getChunk(x >> Chunk::pcShift, y >> Chunk::pcShift);
-	u32 newState = state ? 1 : 0; // these numbers should have a special meaning
+	loadChunk(x >> Chunk::pcShift, y >> Chunk::pcShift, [this, x, y, state] (Chunk * chunk) {
+		if (!chunk) {
+			return;
+		}
 
-	// x and y are 16x16 aligned
-	chunk.setProtectionGid(x, y, newState);
+		u32 newState = state ? 1 : 0; // these numbers should have a special meaning
 
-	if (players.size() != 0) {
-		broadcast(ProtectionUpdate(x, y, newState));
-	}
+		// x and y are 16x16 aligned
+		chunk->setProtectionGid(x, y, newState);
+
+		if (players.size() != 0) {
+			broadcast(ProtectionUpdate(x, y, newState));
+		}
+	});
 }
 
 void World::broadcast(const PrepMsg& prep) {
@@ -393,16 +940,131 @@ void World::broadcast(const PrepMsg& prep) {
 	}
 }
 
+// the chunks are copied here, and written in parallel by TaskBuffer threads
 bool World::save() {
 	bool didStuff = false;
-	for (auto& chunk : chunks) {
-		didStuff |= chunk.second.save();
+	// everything logged until now will be on disk once the chunks are written,
+	// unless another save is still running, with older snapshots
+	if (pendingSaves == 0) {
+		savedLogSegment = getPixelLog().rotate();
+		saveCoversLog = getUnreplayedPixels().empty();
+	}
+
+	// if the last save is still going through its queue, the chunks
+	// changed since are written by the next one
+	if (saveQueue.empty()) {
+		for (auto& chunk : chunks) {
+			// one write per chunk at a time, so they can't finish out of order
+			if (chunk.second.isLoaded() && chunk.second.isDirty() && !chunk.second.isSaving()) {
+				saveQueue.push_back(chunk.first);
+				didStuff = true;
+			}
+		}
 	}
 
+	saveQueued();
+	if (pendingSaves == 0) {
+		saveEnded();
+	}
+
+	didStuff |= pyramid.save();
 	didStuff |= WorldStorage::save();
 	return didStuff;
 }
 
+// starts writing queued chunks, up to WORLD_MAX_SAVES_IN_FLIGHT. the queue
+// is empty when this returns with nothing pending
+void World::saveQueued() {
+	while (!saveQueue.empty() && pendingSaves < WORLD_MAX_SAVES_IN_FLIGHT) {
+		auto search = chunks.find(saveQueue.front());
+		saveQueue.pop_front();
+		// unloaded chunks were saved then
+		if (search != chunks.end() && search->second.isLoaded()
+				&& search->second.isDirty() && !search->second.isSaving()) {
+			saveChunk(search->second);
+		}
+	}
+}
+
+void World::saveChunk(Chunk& chunk) {
+	chunk.preventUnloading(true);
+	++pendingSaves;
+	saves.taskQueued();
+
+	RegionCache& regions = getRegionCache();
+	tb.queue([this, &chunk, &regions, snap{chunk.snapshot()}] (TaskBuffer& tb) {
+		sz_t written = 0;
+		try {
+			written = Chunk::writeSnapshot(regions, *snap);
+		} catch (const std::exception& e) {
+			std::cerr << "Error while saving chunk: " << e.what() << std::endl;
+		}
+
+		tb.runInMainThread([this, &chunk, written] (TaskBuffer&) {
+			chunkSaved(chunk, written);
+		});
+	});
+}
+
+void World::chunkSaved(Chunk& chunk, sz_t written) {
+	chunk.snapshotSaved(written != 0);
+	chunk.preventUnloading(false);
+	if (written != 0) {
+		saves.chunkWritten(written);
+	} else {
+		// still dirty, it's written again on the next save
+		saves.chunkFailed();
+		saveFailed = true;
+	}
+
+	// once the last chunk is written, flush the regions to disk
+	--pendingSaves;
+	saveQueued();
+	if (pendingSaves == 0) {
+		++pendingSaves;
+		saves.taskQueued();
+		RegionCache& regions = getRegionCache();
+		tb.queue([this, &regions] (TaskBuffer& tb) {
+			bool synced = true;
+			try {
+				regions.syncAll();
+			} catch (const std::exception& e) {
+				std::cerr << "Error while syncing regions: " << e.what() << std::endl;
+				synced = false;
+			}
+
+			tb.runInMainThread([this, synced] (TaskBuffer&) {
+				saveFailed |= !synced;
+				if (--pendingSaves == 0) {
+					saveEnded();
+				}
+
+				saves.taskDone();
+				tryUnloadWorld();
+			});
+		});
+	}
+
+	saves.taskDone();
+	tryUnloadWorld();
+}
+
+// the pixels logged before the save started are on disk, unless something
+// failed. then they're kept until a later save writes every chunk
+void World::saveEnded() {
+	if (!saveFailed && savedLogSegment != 0) {
+		if (saveCoversLog) {
+			// pixels of chunks that failed to save before are on disk now
+			getPixelLog().chunksSaved();
+		}
+
+		getPixelLog().discardBefore(savedLogSegment);
+	}
+
+	savedLogSegment = 0;
+	saveFailed = false;
+}
+
 sz_t World::getPlayerCount() const {
 	return players.size();
 }
@@ -411,6 +1073,14 @@ std::string_view World::getMotd() const {
 	return WorldStorage::getMotd();
 }
 
+sz_t World::getLoadingChunkCount() const {
+	return loadingChunks.size();
+}
+
+World::FloatMicros World::getAverageChunkLoadTime() const {
+	return averageChunkLoadTime;
+}
+
 std::optional<User::Id> World::getOwner() const {
 	return std::nullopt;
 }
@@ -419,23 +1089,25 @@ void World::restrictDrawing(bool s) {
 	drawRestricted = s;
 }
 
-bool World::isActionPaintAllowed(const Chunk& c, World::Pos x, World::Pos y, Player& p) {
+bool World::isActionPaintAllowed(const Chunk& c, World::Pos x, World::Pos y, Player::Id pid) {
 	x >>= Chunk::pSizeShift;
 	y >>= Chunk::pSizeShift;
 
 	return c.getProtectionGid(x, y) == 0 /*|| rank >= Client::MODERATOR*/;
 }
 
+// dirty chunks stay until a save writes them, their pixels would only be in the log
 bool World::tryUnloadAllChunks() {
 	for (auto it = chunks.begin(); it != chunks.end();) {
-		it = it->second.shouldUnload(true) ? chunks.erase(it) : std::next(it);
+		it = it->second.shouldUnload(true) && !it->second.isDirty() ? chunks.erase(it) : std::next(it);
 	}
 
 	return chunks.size() == 0;
 }
 
 void World::tryUnloadWorld() {
-	if (!players.size() && tryUnloadAllChunks()) {
+	if (!players.size() && ongoingFileReads.empty() && !pyramid.isBusy()
+			&& pendingSaves == 0 && tryUnloadAllChunks()) {
 		unload();
 	}
 }
@@ -2,9 +2,11 @@
 
 #include <Storage.hpp>
 #include <Chunk.hpp>
+#include <TilePyramid.hpp>
 #include <Player.hpp>
 #include <User.hpp>
 #include <types.hpp>
+#include <config.hpp>
 
 #include <color.hpp>
 #include <explints.hpp>
@@ -15,40 +17,83 @@
 #include <set>
 #include <unordered_map>
 #include <map>
+#include <deque>
 #include <optional>
 #include <vector>
 #include <tuple>
 #include <memory>
 #include <limits>
+#include <functional>
+#include <chrono>
 
 class TaskBuffer;
+class ChunkCache;
+class SaveProgress;
+struct EvictableChunk;
 class Client;
 class Request;
 
 class World : public WorldStorage {
 public:
 	using Pos = i32;
+	using FloatMicros = std::chrono::duration<float, std::chrono::microseconds::period>;
 
 	static constexpr Chunk::Pos border = std::numeric_limits<Pos>::max() / Chunk::size;
+	static constexpr u32 areaShift = Chunk::posShift + WORLD_INTEREST_AREA_SHIFT;
+
+	enum class PaintResult {
+		DENIED, // not allowed, or out of range
+		APPLIED,
+		QUEUED // the chunk is loading, checked and applied once it loads
+	};
 
 private:
+	struct InterestArea {
+		std::vector<std::reference_wrapper<Player>> viewers; // players with their cursor here
+		std::vector<u32> cursors; // indexes to playerUpdates, valid during sendUpdates
+		std::vector<u32> pixels; // indexes to pixelUpdates
+		u32 idleUpdates = 0; // erased after WORLD_INTEREST_AREA_IDLE_UPDATES
+	};
+
 	IdSys<Player::Id> ids;
 	TaskBuffer& tb; // for http chunk requests
+	ChunkCache& cache;
+	SaveProgress& saves;
+	TilePyramid pyramid;
+	u32 pendingSaves; // chunk writes and syncs in TaskBuffer threads
+	std::deque<u64> saveQueue; // dirty chunks waiting for a write, see WORLD_MAX_SAVES_IN_FLIGHT
+	u32 savedLogSegment; // pixel log segments below this are discarded when the save ends
+	bool saveFailed; // a chunk write or region sync failed, the log is kept until the next save
+	bool saveCoversLog; // every logged pixel was in a loaded chunk when the save started
 	bool updateRequired;
 	bool drawRestricted; // TODO: use to restrict drawing to owner only
+	FloatMicros averageChunkLoadTime;
 
 	std::function<void()> unload;
 
 	std::set<std::reference_wrapper<Player>> players;
 	std::unordered_map<u64, Chunk> chunks;
 	std::map<u64, std::vector<ll::shared_ptr<Request>>> ongoingChunkRequests;
+	// requests waiting for a png chunk or tile file to be read in the background, by path
+	std::map<std::string, std::vector<ll::shared_ptr<Request>>> ongoingFileReads;
+	// actions waiting for a chunk to be read from disk, called with nullptr if it fails
+	std::unordered_map<u64, std::vector<std::function<void(Chunk *)>>> loadingChunks;
 
 	std::vector<pixupd_t> pixelUpdates;
-	std::set<std::reference_wrapper<Player>> playerUpdates;
-	std::set<Player::Id> playersLeft; // this might be removed
+	std::vector<std::reference_wrapper<Player>> playerUpdates; // in order of arrival, see Player::isUpdateQueued
+	std::vector<Player::Id> playersLeft;
+	std::unique_ptr<u8[]> updateBuf; // reused on every sendUpdates
+
+	// players only get updates from the areas around their cursor, areas are
+	// kept between updates so their vectors are reused
+	std::unordered_map<u64, InterestArea> areas;
+	std::unordered_map<Player::Id, u64> playerAreas; // area of each player on the last update
+	std::vector<u32> areaCursors;
+	std::vector<u32> areaPixels;
+	std::vector<u64> enteredAreas;
 
 public:
-	World(std::tuple<std::string, std::string>, TaskBuffer&);
+	World(std::tuple<std::string, std::string>, TaskBuffer&, ChunkCache&, SaveProgress&);
 	~World();
 
 	World(const World&) = delete;
@@ -58,24 +103,30 @@ public:
 	void configurePlayerBuilder(Player::Builder&);
 	void playerJoined(Player&);
 	void playerUpdated(Player&);
+	void settingsChanged();
 	void playerLeft(Player&);
 
 	void schedUpdates();
 	void sendUpdates();
 
 	sz_t unloadOldChunks(bool force = false);
+	u64 listEvictableChunks(std::vector<EvictableChunk>&);
+	sz_t evictChunk(u64 key);
+	u64 listPngCaches(std::vector<EvictableChunk>&);
+	sz_t dropPngCache(u64 key);
 
 	static bool verifyChunkPos(Chunk::Pos x, Chunk::Pos y);
-	Chunk& getChunk(Chunk::Pos x, Chunk::Pos y);
+	Chunk * getLoadedChunk(Chunk::Pos x, Chunk::Pos y);
+	void loadChunk(Chunk::Pos x, Chunk::Pos y, std::function<void(Chunk *)> onLoad);
 
 	void sendUserUpdate(User&);
 	void sendPlayerCountStats(u32 globalPlayerCount);
-	bool sendChunk(Chunk::Pos x, Chunk::Pos y, ll::shared_ptr<Request>);
+	bool sendChunk(Chunk::Pos x, Chunk::Pos y, u8 downscaling, ll::shared_ptr<Request>);
 	//void cancelChunkRequest(Chunk::Pos x, Chunk::Pos y, ll::shared_ptr<Request>);
 
 	void setAreaProtection(Chunk::ProtPos x, Chunk::ProtPos y, bool state);
 
-	bool paint(Player&, World::Pos x, World::Pos y, RGB_u);
+	PaintResult paint(Player&, World::Pos x, World::Pos y, RGB_u);
 
 	void chat(Player&, const std::string&);
 	void broadcast(const PrepMsg&);
@@ -83,13 +134,29 @@ public:
 	bool save();
 
 	sz_t getPlayerCount() const;
+	sz_t getLoadingChunkCount() const;
+	FloatMicros getAverageChunkLoadTime() const;
 	std::string_view getMotd() const;
 	std::optional<User::Id> getOwner() const;
 
 	void restrictDrawing(bool);
 
 private:
-	bool isActionPaintAllowed(const Chunk&,  World::Pos x,  World::Pos y, Player&);
+	static u64 areaKey(World::Pos x, World::Pos y);
+	template<typename Fn>
+	void forEachAreaAround(i32 ax, i32 ay, Fn);
+	void sendAreaUpdate(const std::vector<std::reference_wrapper<Player>>&, sz_t leftCount);
+
+	void chunkLoaded(Chunk&, u64 k, std::chrono::steady_clock::time_point start);
+	void chunkLoadFailed(u64 k, const std::string& error);
+	bool sendLoadedChunk(Chunk&, ll::shared_ptr<Request>);
+	void sendFile(std::string path, ll::shared_ptr<Request>, std::function<void(ll::shared_ptr<Request>)> onMissing);
+	void saveQueued();
+	void saveChunk(Chunk&);
+	void chunkSaved(Chunk&, sz_t written);
+	void saveEnded();
+	bool applyPaint(Chunk&, Player::Id, World::Pos x, World::Pos y, RGB_u);
+	bool isActionPaintAllowed(const Chunk&,  World::Pos x,  World::Pos y, Player::Id);
 	bool tryUnloadAllChunks();
 	void tryUnloadWorld();
 };
@@ -2,6 +2,8 @@
 
 #include <iostream>
 #include <utility>
+#include <vector>
+#include <algorithm>
 #include <Storage.hpp>
 //#include <TaskBuffer.hpp>
 #include <TimedCallbacks.hpp>
@@ -9,6 +11,7 @@
 WorldManager::WorldManager(TaskBuffer& tb, TimedCallbacks& tc, Storage& s)
 : tb(tb),
   s(s),
+  cache(s.getChunkCacheSize(), s.getPngCacheSize()),
   averageTickInterval(50000),
   lastTickOn(std::chrono::steady_clock::now()) {
 	tickTimer = tc.startTimer([this] {
@@ -20,6 +23,12 @@ WorldManager::WorldManager(TaskBuffer& tb, TimedCallbacks& tc, Storage& s)
 		unloadOldChunks();
 		return true;
 	}, 65000);
+
+	cacheTimer = tc.startTimer([this] {
+		evictPngCaches();
+		evictChunks();
+		return true;
+	}, 1000);
 }
 
 bool WorldManager::verifyWorldName(const std::string& name) {
@@ -61,7 +70,7 @@ World& WorldManager::getOrLoadWorld(std::string name) {
 		sr = worlds.emplace(
 			std::piecewise_construct,
 			std::forward_as_tuple(name),
-			std::forward_as_tuple(s.getWorldStorageArgsFor(name), tb)
+			std::forward_as_tuple(s.getWorldStorageArgsFor(name), tb, cache, saves)
 		).first;
 
 		sr->second.setUnloadFunc([this, sr] {
@@ -84,6 +93,7 @@ sz_t WorldManager::loadedWorlds() const {
 	return worlds.size();
 }
 
+// chunks are written in the background, see SaveProgress
 bool WorldManager::saveAll() {
 	bool didStuff = false;
 	for (auto& w : worlds) {
@@ -102,6 +112,89 @@ sz_t WorldManager::unloadOldChunks(bool all) {
 	return totalUnloaded;
 }
 
+// unloads the least recently used chunks of all worlds until below the budget
+sz_t WorldManager::evictChunks() {
+	std::vector<EvictableChunk> candidates;
+	u64 used = 0;
+	for (auto& w : worlds) {
+		used += w.second.listEvictableChunks(candidates);
+	}
+
+	cache.setUsedBytes(used);
+	if (!cache.isOverBudget()) {
+		return 0;
+	}
+
+	// free a bit more than needed, so this doesn't run on every tick
+	const u64 target = cache.getBudget() / 8 * 7;
+	std::sort(candidates.begin(), candidates.end(), [] (const auto& a, const auto& b) {
+		return a.lastAction < b.lastAction;
+	});
+
+	sz_t evicted = 0;
+	for (const auto& c : candidates) {
+		if (used <= target) {
+			break;
+		}
+
+		if (sz_t freed = c.world->evictChunk(c.key)) {
+			used -= std::min<u64>(used, freed);
+			++evicted;
+		}
+	}
+
+	cache.setUsedBytes(used);
+	return evicted;
+}
+
+// drops the least recently used chunk pngs until below the png budget
+sz_t WorldManager::evictPngCaches() {
+	std::vector<EvictableChunk> candidates;
+	u64 used = 0;
+	for (auto& w : worlds) {
+		used += w.second.listPngCaches(candidates);
+	}
+
+	cache.setPngUsedBytes(used);
+	if (!cache.isPngOverBudget()) {
+		return 0;
+	}
+
+	const u64 target = cache.getPngBudget() / 8 * 7;
+	std::sort(candidates.begin(), candidates.end(), [] (const auto& a, const auto& b) {
+		return a.lastAction < b.lastAction;
+	});
+
+	sz_t dropped = 0;
+	for (const auto& c : candidates) {
+		if (used <= target) {
+			break;
+		}
+
+		if (sz_t freed = c.world->dropPngCache(c.key)) {
+			used -= std::min<u64>(used, freed);
+			++dropped;
+		}
+	}
+
+	cache.setPngUsedBytes(used);
+	return dropped;
+}
+
+// in percent of the configured sizes, lowered under memory pressure
+void WorldManager::setCacheBudgets(u8 chunkPercent, u8 pngPercent) {
+	cache.setBudget(s.getChunkCacheSize() / 100 * chunkPercent);
+	cache.setPngBudget(s.getPngCacheSize() / 100 * pngPercent);
+}
+
+const ChunkCache& WorldManager::getChunkCache() const {
+	return cache;
+}
+
+const SaveProgress& WorldManager::getSaveProgress() const {
+	return saves;
+}
+
 float WorldManager::getTps() const {
 	return (std::chrono::seconds(1) / averageTickInterval);
 }
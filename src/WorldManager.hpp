@@ -6,6 +6,8 @@
 #include <chrono>
 
 #include <World.hpp>
+#include <ChunkCache.hpp>
+#include <SaveProgress.hpp>
 
 #include <explints.hpp>
 
@@ -19,6 +21,8 @@ class WorldManager {
 	std::map<std::string, World> worlds;
 	TaskBuffer& tb;
 	Storage& s;
+	ChunkCache cache;
+	SaveProgress saves;
 
 	FloatMicros averageTickInterval;
 	//std::chrono::microseconds averageTickCost;
@@ -26,6 +30,7 @@ class WorldManager {
 
 	u32 tickTimer;
 	u32 ageTimer;
+	u32 cacheTimer;
 
 public:
 	WorldManager(TaskBuffer&, TimedCallbacks&, Storage&);
@@ -44,6 +49,11 @@ public:
 	bool saveAll();
 
 	sz_t unloadOldChunks(bool all = false);
+	sz_t evictChunks();
+	sz_t evictPngCaches();
+	void setCacheBudgets(u8 chunkPercent, u8 pngPercent);
+	const ChunkCache& getChunkCache() const;
+	const SaveProgress& getSaveProgress() const;
 
 	float getTps() const;
 
@@ -1,3 +1,4 @@
+#pragma once
 
 /***
  * World config
@@ -6,6 +7,9 @@
 /* Will close old file handles */
 #define WORLD_MAX_FILE_HANDLES 16
 #define WORLD_MAX_CHUNKS_LOADED 2048
+/* Default budget for the encoded chunk pngs kept in memory, they're */
+/* dropped before any chunk is unloaded */
+#define WORLD_PNG_CACHE_MB 256
 
 /* Negative and positive X and Y range of chunks allowed to be created */
 #define WORLD_MAX_CHUNK_XY 0xFFFFF
@@ -21,6 +25,43 @@
 /* Maximum value is 65535, max pixel updates every WORLD_UPDATE_RATE_MSEC */
 #define WORLD_MAX_PIXEL_UPDATES 4096
 
+/* Cursor and pixel updates are only sent to players with their cursor nearby */
+/* Size of an interest area, in chunks (log2) */
+#define WORLD_INTEREST_AREA_SHIFT 2
+/* Amount of areas around the player's own area that it gets updates from */
+#define WORLD_INTEREST_AREA_RADIUS 1
+/* Updates an area with no players or changes is kept for, before it's freed */
+#define WORLD_INTEREST_AREA_IDLE_UPDATES 512
+
+/* Chunk snapshots being written at once on a save, each holds a copy of */
+/* the pixels. The other dirty chunks wait for one to finish */
+#define WORLD_MAX_SAVES_IN_FLIGHT 16
+
+/* Painted pixels are logged to disk until their chunk is saved */
+/* Max time a pixel waits in memory before the log is written and synced */
+#define WORLD_PIXEL_LOG_COMMIT_MSEC 200
+
+/***
+ * Server config
+ ***/
+
+/* Memory pressure checks, in percent of the cgroup or physical memory limit */
+/* Above the soft limit the chunk cache budgets are lowered one step, waiting */
+/* longer between steps while it lasts. Above the hard limit they're halved */
+/* on every check. They're raised again once below the recover limit */
+#define SERVER_MEMORY_CHECK_MSEC 1000
+#define SERVER_MEMORY_RECOVER_PERCENT 65
+#define SERVER_MEMORY_SOFT_PERCENT 75
+#define SERVER_MEMORY_HARD_PERCENT 90
+/* Lowest the budgets go, in percent of the configured sizes */
+#define SERVER_MEMORY_MIN_BUDGET_PERCENT 10
+
+/* New connections allowed per ip, and per /24 or /48 (burst, per n seconds) */
+#define SERVER_ADMISSION_IP_RATELIMIT 8, 30
+#define SERVER_ADMISSION_PREFIX_RATELIMIT 48, 30
+/* Ips and prefixes tracked at once, power of 2 */
+#define SERVER_ADMISSION_TABLE_SIZE 16384
+
 /***
  * Client config
  ***/
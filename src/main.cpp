@@ -1,6 +1,5 @@
 #include <iostream>
 #include <memory>
-#include <new>
 
 #include <Server.hpp>
 
@@ -11,15 +10,6 @@ void stopServer() {
 	s->stop();
 }
 
-void outOfMemoryHandler() {
-	std::cerr << "Out of mem! Trying to free some." << std::endl;
-	
-	if (!s->freeMemory()) {
-		std::cerr << "Couldn't free any memory :(" << std::endl;
-		throw std::bad_alloc();
-	}
-}
-
 #ifdef _WIN32
 #include <windows.h>
 
@@ -56,8 +46,6 @@ bool installSignalHandler() {
 int main(int argc, char * argv[]) {
 	std::cout << "Starting server..." << std::endl;
 	
-	std::set_new_handler(outOfMemoryHandler);
-
 	if (!installSignalHandler()) {
 		std::cerr << "Failed to install signal handler" << std::endl;
 	}